@@ -1,20 +1,57 @@
+import 'dart:typed_data';
+
 import 'package:flutter/services.dart' show rootBundle;
 import 'package:flutter_js/javascript_runtime.dart';
+import 'package:flutter_js/js_eval_result.dart';
+import 'package:flutter_js/quickjs/quickjs_runtime2.dart';
 import './xhr.dart';
 
 var _fetchDebug = false;
 
 setFetchDebug(bool value) => _fetchDebug = value;
 
+/// fetch.js is the same for every runtime, so it is read only once.
+String? _fetchPolyfill;
+Uint8List? _fetchPolyfillBytes;
+
 extension JavascriptRuntimeFetchExtension on JavascriptRuntime {
   Future<JavascriptRuntime> enableFetch() async {
     debug('Before enable xhr');
     enableXhr();
     debug('After enable xhr');
-    final fetchPolyfill =
-        await rootBundle.loadString('packages/flutter_js/assets/js/fetch.js');
-    debug('Loaded fetchPolyfill');
-    final evalFetchResult = evaluate(fetchPolyfill);
+    const fetchAsset = 'packages/flutter_js/assets/js/fetch.js';
+    final runtime = this;
+    if (lazyPolyfills) {
+      // The source has to be at hand before the first synchronous access,
+      // so the asset is loaded now and only compiled by the installer.
+      final JsEvalResult Function() install;
+      if (runtime is QuickJsRuntime2) {
+        final fetchPolyfill = _fetchPolyfillBytes ??= await rootBundle
+            .load(fetchAsset)
+            .then((data) => data.buffer
+                .asUint8List(data.offsetInBytes, data.lengthInBytes));
+        install = () => runtime.evaluateBytes(fetchPolyfill, name: fetchAsset);
+      } else {
+        final fetchPolyfill =
+            _fetchPolyfill ??= await rootBundle.loadString(fetchAsset);
+        install = () => evaluate(fetchPolyfill);
+      }
+      debug('Loaded fetchPolyfill');
+      defineLazyGlobals('fetch', ['fetch'], () {
+        final evalFetchResult = install();
+        debug('Eval Fetch Result: $evalFetchResult');
+      });
+      return this;
+    }
+    final JsEvalResult evalFetchResult;
+    if (runtime is QuickJsRuntime2) {
+      evalFetchResult = await runtime.evaluateAsset(fetchAsset);
+    } else {
+      final fetchPolyfill =
+          _fetchPolyfill ??= await rootBundle.loadString(fetchAsset);
+      debug('Loaded fetchPolyfill');
+      evalFetchResult = evaluate(fetchPolyfill);
+    }
     debug('Eval Fetch Result: $evalFetchResult');
     return this;
   }
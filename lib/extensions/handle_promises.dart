@@ -7,6 +7,19 @@ const REGISTER_PROMISE_FUNCTION = 'FLUTTER_NATIVEJS_REGISTER_PROMISE';
 
 extension HandlePromises on JavascriptRuntime {
   enableHandlePromises() {
+    defineLazyGlobals('promises', [
+      'FLUTTER_NATIVEJS_PENDING_PROMISES',
+      'FLUTTER_NATIVEJS_PENDING_PROMISES_COUNT',
+      REGISTER_PROMISE_FUNCTION,
+      'FLUTTER_NATIVEJS_CLEAN_PROMISE',
+      'FLUTTER_NATIVEJS_IS_PENDING_PROMISE',
+      'FLUTTER_NATIVEJS_IS_FULLFILLED_PROMISE',
+      'FLUTTER_NATIVEJS_IS_REJECTED_PROMISE',
+      'FLUTTER_NATIVEJS_MakeQuerablePromise',
+    ], _installPromiseHelpers);
+  }
+
+  void _installPromiseHelpers() {
     final fnRegisterPromise = evaluate(""" 
      var FLUTTER_NATIVEJS_PENDING_PROMISES = {};
       var FLUTTER_NATIVEJS_PENDING_PROMISES_COUNT = -1;
@@ -0,0 +1,286 @@
+import 'dart:async';
+import 'dart:isolate';
+
+import 'package:flutter_js/javascript_runtime.dart';
+import 'package:flutter_js/quickjs/quickjs_runtime2.dart';
+
+// ignore: non_constant_identifier_names
+var _WORKER_DEBUG = false;
+
+setWorkerDebug(bool value) => _WORKER_DEBUG = value;
+
+const WORKERS_KEY = 'FLUTTER_JS_WORKERS';
+
+const _WORKER_DISPATCH_KEY = 'FLUTTER_JS_WORKER_DISPATCH';
+
+final String workerJsCode = """
+var FLUTTER_JS_WORKERS = {};
+var FLUTTER_JS_WORKER_COUNT = -1;
+function Worker(source) {
+  FLUTTER_JS_WORKER_COUNT += 1;
+  this._id = FLUTTER_JS_WORKER_COUNT;
+  this.onmessage = null;
+  this.onerror = null;
+  FLUTTER_JS_WORKERS[this._id] = this;
+  sendMessage('WorkerNative', JSON.stringify(['spawn', this._id, String(source)]));
+};
+Worker.prototype.constructor = Worker;
+Worker.prototype.postMessage = function(data) {
+  FLUTTER_JS_WORKER_POST(this._id, data);
+};
+Worker.prototype.terminate = function() {
+  delete FLUTTER_JS_WORKERS[this._id];
+  sendMessage('WorkerNative', JSON.stringify(['terminate', this._id]));
+};
+Worker.prototype._dispatch = function(type, data) {
+  var handler = type === 'error' ? this.onerror : this.onmessage;
+  if (typeof handler !== 'function') return;
+  handler.call(this, type === 'error' ? { message: data } : { data: data });
+};
+""";
+
+final String workerScopeJsCode = """
+var self = globalThis;
+var onmessage = null;
+function postMessage(data) {
+  FLUTTER_JS_WORKER_POST(data);
+}
+function close() {
+  sendMessage('WorkerClose', '[]');
+}
+""";
+
+/// Hands an event of a worker to its js object, resolved once per runtime.
+const String _workerDispatchJsCode = """(id, type, data) => {
+  const worker = FLUTTER_JS_WORKERS[id];
+  if (worker) worker._dispatch(type, data);
+}""";
+
+/// Parent side of a worker: the isolate running its runtime and the
+/// messages posted before that runtime was ready.
+class _WorkerHandle {
+  final int id;
+  final ReceivePort port = ReceivePort();
+
+  /// Uncaught errors of the isolate as `[error, stack]`, and null once it
+  /// exits.
+  final ReceivePort status = ReceivePort();
+  Isolate? isolate;
+  SendPort? sendPort;
+  List<JSCloneData>? pending = [];
+  _WorkerHandle(this.id);
+
+  void post(JSCloneData data) {
+    final sendPort = this.sendPort;
+    if (sendPort != null) {
+      sendPort.send(['message', data]);
+    } else if (pending != null) {
+      pending!.add(data);
+    } else {
+      data.discard();
+    }
+  }
+
+  void terminate() {
+    final sendPort = this.sendPort;
+    if (sendPort != null) {
+      // let the worker free its runtime before the isolate exits
+      sendPort.send(['terminate']);
+    } else {
+      isolate?.kill(priority: Isolate.immediate);
+    }
+    for (final data in pending ?? <JSCloneData>[]) {
+      data.discard();
+    }
+    pending = null;
+    port.close();
+    status.close();
+  }
+}
+
+extension JavascriptRuntimeWorkerExtension on JavascriptRuntime {
+  /// Install a `Worker` global. Every worker runs its script in its own
+  /// [QuickJsRuntime2] on a separate isolate, and therefore on its own
+  /// thread. Messages are structured clones, see [JSCloneData], and
+  /// SharedArrayBuffers share their memory where [jsCanShareMemory] holds.
+  /// `Atomics.wait` blocks in workers only, not in this runtime.
+  ///
+  /// Workers need this runtime to be a [QuickJsRuntime2] too: the
+  /// JavaScriptCore runtime has no QuickJS library to run them with.
+  JavascriptRuntime enableWorkers() {
+    final runtime = this;
+    if (runtime is! QuickJsRuntime2) {
+      throw UnsupportedError(
+          'Workers need a QuickJsRuntime2, not a ${runtime.runtimeType}');
+    }
+    runtime.enableSharedMemory();
+    final workers = <int, _WorkerHandle>{};
+    dartContext[WORKERS_KEY] = workers;
+    onDispose(terminateWorkers);
+
+    defineLazyGlobals('worker', [
+      'Worker',
+      'FLUTTER_JS_WORKERS',
+      'FLUTTER_JS_WORKER_COUNT',
+      'FLUTTER_JS_WORKER_POST',
+    ], () {
+      final evalWorkerResult = this.evaluate(workerJsCode);
+      if (_WORKER_DEBUG) print('RESULT evalWorkerResult: $evalWorkerResult');
+      runtime.defineCloneReceiver('FLUTTER_JS_WORKER_POST', (args, data) {
+        final worker = isDisposed ? null : workers[args[0]];
+        if (worker == null) {
+          data.discard();
+        } else {
+          worker.post(data);
+        }
+      });
+    });
+
+    this.onMessage('WorkerNative', (arguments) {
+      if (isDisposed) return;
+      final String command = arguments[0];
+      final int id = arguments[1];
+      switch (command) {
+        case 'spawn':
+          final worker = _WorkerHandle(id);
+          workers[id] = worker;
+          worker.port.listen((message) {
+            _onWorkerMessage(worker, message);
+          });
+          worker.status.listen((message) {
+            if (message != null) {
+              _dispatchWorkerEvent(worker, 'error', message[0]);
+            } else if (workers.remove(id) != null) {
+              worker.terminate();
+            }
+          });
+          Isolate.spawn(
+            _workerMain,
+            [worker.port.sendPort, arguments[2] as String],
+            debugName: 'flutter_js worker $id',
+            onError: worker.status.sendPort,
+            onExit: worker.status.sendPort,
+          ).then((isolate) {
+            if (worker.pending == null) {
+              isolate.kill(priority: Isolate.immediate);
+            } else {
+              worker.isolate = isolate;
+            }
+          }, onError: (e) {
+            _dispatchWorkerEvent(worker, 'error', e.toString());
+            workers.remove(id);
+            worker.terminate();
+          });
+          break;
+        case 'terminate':
+          workers.remove(id)?.terminate();
+          break;
+      }
+    });
+    return this;
+  }
+
+  /// Stop all workers started by this runtime.
+  void terminateWorkers() {
+    final workers = dartContext[WORKERS_KEY] as Map<int, _WorkerHandle>?;
+    if (workers == null) return;
+    for (final worker in workers.values) {
+      worker.terminate();
+    }
+    workers.clear();
+    (dartContext.remove(_WORKER_DISPATCH_KEY) as JSFunctionHandle?)?.release();
+  }
+
+  void _onWorkerMessage(_WorkerHandle worker, dynamic message) {
+    final String type = message[0];
+    if (isDisposed) {
+      if (type == 'message') (message[1] as JSCloneData).discard();
+      return;
+    }
+    switch (type) {
+      case 'ready':
+        worker.sendPort = message[1];
+        for (final data in worker.pending ?? []) {
+          worker.sendPort!.send(['message', data]);
+        }
+        worker.pending = [];
+        return;
+      case 'close':
+        (dartContext[WORKERS_KEY] as Map<int, _WorkerHandle>?)
+            ?.remove(worker.id);
+        worker.terminate();
+        return;
+    }
+    if (_WORKER_DEBUG) print('Worker ${worker.id} $type: ${message[1]}');
+    _dispatchWorkerEvent(worker, type, message[1]);
+  }
+
+  /// Call the `onmessage` or `onerror` handler of [worker] with [data], a
+  /// [JSCloneData] or an error message.
+  void _dispatchWorkerEvent(_WorkerHandle worker, String type, dynamic data) {
+    if (isDisposed) return;
+    final runtime = this as QuickJsRuntime2;
+    final JSFunctionHandle dispatch = dartContext[_WORKER_DISPATCH_KEY] ??=
+        runtime.resolveFunction(_workerDispatchJsCode);
+    try {
+      if (data is JSCloneData) {
+        runtime.callWithClone(dispatch, [worker.id, type], data);
+      } else {
+        dispatch.call([worker.id, type, data]);
+      }
+    } catch (e) {
+      if (_WORKER_DEBUG) print('Worker ${worker.id} $type handler: $e');
+    }
+    this.executePendingJob();
+  }
+}
+
+/// Entry point of a worker isolate.
+void _workerMain(List args) {
+  final SendPort parent = args[0];
+  final String source = args[1];
+  final port = ReceivePort();
+  final runtime = QuickJsRuntime2();
+  runtime.enableSharedMemory(canBlock: true);
+
+  void shutdown() {
+    port.close();
+    runtime.dispose();
+    Isolate.exit();
+  }
+
+  runtime.evaluate(workerScopeJsCode);
+  runtime.defineCloneReceiver('FLUTTER_JS_WORKER_POST', (_, data) {
+    parent.send(['message', data]);
+  });
+  runtime.onMessage('WorkerClose', (_) {
+    parent.send(['close']);
+  });
+
+  final result = runtime.evaluate(source, name: '<worker>');
+  if (result.isError) {
+    parent.send(['error', result.stringResult]);
+  }
+  runtime.executePendingJob();
+
+  final dispatch = runtime.resolveFunction(
+    "(data) => { if (typeof onmessage === 'function') onmessage({ data: data }); }",
+  );
+  port.listen((message) {
+    switch (message[0]) {
+      case 'message':
+        try {
+          runtime.callWithClone(dispatch, [], message[1]);
+        } catch (e) {
+          parent.send(['error', e.toString()]);
+        }
+        runtime.executePendingJob();
+        break;
+      case 'terminate':
+        dispatch.release();
+        shutdown();
+        break;
+    }
+  });
+  parent.send(['ready', port.sendPort]);
+}
@@ -344,32 +344,39 @@ extension JavascriptRuntimeXhrExtension on JavascriptRuntime {
       });
     });
 
-    final evalXhrSendNative = this.evaluate("""
-    var xhrRequests = {};
-    var idRequest = -1;
-    function XMLHttpRequestExtension_send_native() {
-      idRequest += 1;
-      var cb = arguments[4];
-      var context = arguments[5];
-      xhrRequests[idRequest] = {
-        callback: function(responseInfo, responseText, error) {
-          cb(responseInfo, responseText, error);
-        }
-      };
-      var args = [];
-      args[0] = arguments[0];
-      args[1] = arguments[1];
-      args[2] = arguments[2];
-      args[3] = arguments[3];
-      args[4] = idRequest;
-      sendMessage('SendNative', JSON.stringify(args));
-    }
-    """);
+    defineLazyGlobals('xhr', [
+      'XMLHttpRequest',
+      'XMLHttpRequestExtension_send_native',
+      'xhrRequests',
+      'idRequest',
+    ], () {
+      final evalXhrSendNative = this.evaluate("""
+      var xhrRequests = {};
+      var idRequest = -1;
+      function XMLHttpRequestExtension_send_native() {
+        idRequest += 1;
+        var cb = arguments[4];
+        var context = arguments[5];
+        xhrRequests[idRequest] = {
+          callback: function(responseInfo, responseText, error) {
+            cb(responseInfo, responseText, error);
+          }
+        };
+        var args = [];
+        args[0] = arguments[0];
+        args[1] = arguments[1];
+        args[2] = arguments[2];
+        args[3] = arguments[3];
+        args[4] = idRequest;
+        sendMessage('SendNative', JSON.stringify(args));
+      }
+      """);
 
-    final evalXhrResult = this.evaluate(xhrJsCode);
-    localContext['enableXhr'] = evalXhrResult.rawResult;
-    localContext['xhrSendNative'] = evalXhrSendNative.rawResult;
-    if (_XHR_DEBUG) print('RESULT evalXhrResult: $evalXhrResult');
+      final evalXhrResult = this.evaluate(xhrJsCode);
+      localContext['enableXhr'] = evalXhrResult.rawResult;
+      localContext['xhrSendNative'] = evalXhrSendNative.rawResult;
+      if (_XHR_DEBUG) print('RESULT evalXhrResult: $evalXhrResult');
+    });
 
     this.onMessage('SendNative', (arguments) {
       try {
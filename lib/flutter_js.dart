@@ -148,8 +148,8 @@ class FlutterJs {
   }
 
   static Future<int?> initEngine(int? engineId) async {
-    Map<dynamic, dynamic> mapResult = await (_methodChannel.invokeMethod(
-        "initEngine", engineId) as Future<Map<dynamic, dynamic>>);
+    final mapResult =
+        await _methodChannel.invokeMapMethod("initEngine", engineId) ?? {};
     _httpPort = mapResult['httpPort'] as int?;
     _httpPassword = mapResult['httpPassword'] as String?;
     return engineId;
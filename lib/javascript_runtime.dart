@@ -64,6 +64,11 @@ class FlutterJsPlatformEmpty extends JavascriptRuntime {
 abstract class JavascriptRuntime {
   static bool debugEnabled = false;
 
+  /// Whether the polyfills of the extensions are only compiled the first
+  /// time script reads one of their globals. Runtimes that support it take
+  /// it as a constructor option; the default installs everything eagerly.
+  bool get lazyPolyfills => false;
+
   @protected
   JavascriptRuntime init() {
     initChannelFunctions();
@@ -76,6 +81,34 @@ abstract class JavascriptRuntime {
 
   Map<String, dynamic> dartContext = {};
 
+  /// Installers of the lazy features whose globals were not read yet.
+  final Map<String, void Function()> _lazyFeatures = {};
+  bool _lazyGlobalsReady = false;
+
+  /// Cleanups registered with [onDispose].
+  final List<void Function()> _disposeHooks = [];
+  bool _disposed = false;
+
+  /// Whether [dispose] was called. Extensions check it to drop work that
+  /// arrives late, instead of bringing the engine back up.
+  bool get isDisposed => _disposed;
+
+  /// Run [hook] when this runtime is disposed, before the engine is freed.
+  /// Extensions use it to stop what they started.
+  void onDispose(void Function() hook) => _disposeHooks.add(hook);
+
+  /// Mark the runtime disposed and run the [onDispose] hooks, latest first.
+  /// Implementations of [dispose] call this first.
+  @protected
+  void runDisposeHooks() {
+    if (_disposed) return;
+    _disposed = true;
+    for (final hook in _disposeHooks.reversed) {
+      hook();
+    }
+    _disposeHooks.clear();
+  }
+
   void dispose();
 
   static Map<String, Map<String, Function(dynamic arg)>>
@@ -99,8 +132,50 @@ abstract class JavascriptRuntime {
 
   int executePendingJob();
 
+  /// Run [install] now, or when [lazyPolyfills] is set, the first time one
+  /// of [globals] is read or written from script. Until then each global is
+  /// an accessor on `globalThis`, so [install] must define all of them.
+  void defineLazyGlobals(
+    String feature,
+    List<String> globals,
+    void Function() install,
+  ) {
+    if (!lazyPolyfills) {
+      install();
+      return;
+    }
+    if (!_lazyGlobalsReady) {
+      _lazyGlobalsReady = true;
+      onMessage('LazyGlobal', (dynamic feature) {
+        _lazyFeatures.remove(feature)?.call();
+      });
+      evaluate(_lazyGlobalsJsCode);
+    }
+    _lazyFeatures[feature] = install;
+    evaluate(
+        "FLUTTER_JS_defineLazyGlobals(${jsonEncode(feature)}, ${jsonEncode(globals)});");
+  }
+
+  /// Install every lazy feature that was not used yet. Globals script has
+  /// already redefined keep their values, and a feature whose globals were
+  /// all redefined is not installed at all.
+  void installLazyGlobals() {
+    for (final feature in _lazyFeatures.keys.toList()) {
+      evaluate("FLUTTER_JS_installLazyGlobals(${jsonEncode(feature)});");
+      _lazyFeatures.remove(feature);
+    }
+  }
+
   void _setupConsoleLog() {
-    evaluate("""
+    evaluate(_consoleJsCode);
+    onMessage('ConsoleLog', (dynamic args) {
+      args..removeAt(0);
+      String output = args.join(' ');
+      print(output);
+    });
+  }
+
+  static const _consoleJsCode = """
     var console = {
       log: function() {
         sendMessage('ConsoleLog', JSON.stringify(['log', ...arguments]));
@@ -111,35 +186,10 @@ abstract class JavascriptRuntime {
       error: function() {
         sendMessage('ConsoleLog', JSON.stringify(['error', ...arguments]));
       }
-    }""");
-    onMessage('ConsoleLog', (dynamic args) {
-      args..removeAt(0);
-      String output = args.join(' ');
-      print(output);
-    });
-  }
+    }""";
 
   void _setupSetTimeout() {
-    evaluate("""
-      var __NATIVE_FLUTTER_JS__setTimeoutCount = -1;
-      var __NATIVE_FLUTTER_JS__setTimeoutCallbacks = {};
-      function setTimeout(fnTimeout, timeout) {
-        // console.log('Set Timeout Called');
-        try {
-        __NATIVE_FLUTTER_JS__setTimeoutCount += 1;
-          var timeoutIndex = '' + __NATIVE_FLUTTER_JS__setTimeoutCount;
-          __NATIVE_FLUTTER_JS__setTimeoutCallbacks[timeoutIndex] =  fnTimeout;
-          ;
-          // console.log(typeof(sendMessage));
-          // console.log('BLA');
-          sendMessage('SetTimeout', JSON.stringify({ timeoutIndex, timeout}));
-            
-        } catch (e) {
-          console.error('ERROR HERE',e.message);
-        }
-      };
-      1
-    """);
+    evaluate(_setTimeoutJsCode);
     //print('SET TIMEOUT EVAL RESULT: $setTImeoutResult');
     onMessage('SetTimeout', (dynamic args) {
       try {
@@ -160,6 +210,27 @@ abstract class JavascriptRuntime {
     });
   }
 
+  static const _setTimeoutJsCode = """
+      var __NATIVE_FLUTTER_JS__setTimeoutCount = -1;
+      var __NATIVE_FLUTTER_JS__setTimeoutCallbacks = {};
+      function setTimeout(fnTimeout, timeout) {
+        // console.log('Set Timeout Called');
+        try {
+        __NATIVE_FLUTTER_JS__setTimeoutCount += 1;
+          var timeoutIndex = '' + __NATIVE_FLUTTER_JS__setTimeoutCount;
+          __NATIVE_FLUTTER_JS__setTimeoutCallbacks[timeoutIndex] =  fnTimeout;
+          ;
+          // console.log(typeof(sendMessage));
+          // console.log('BLA');
+          sendMessage('SetTimeout', JSON.stringify({ timeoutIndex, timeout}));
+            
+        } catch (e) {
+          console.error('ERROR HERE',e.message);
+        }
+      };
+      1
+    """;
+
   sendMessage({
     required String channelName,
     required List<String> args,
@@ -184,3 +255,57 @@ abstract class JavascriptRuntime {
 
   void setInspectable(bool inspectable);
 }
+
+/// Accessors standing in for the globals of features that are not installed
+/// yet. Reading or assigning one drops the accessors of its feature and asks
+/// the host to evaluate the real polyfill before going on. Globals script
+/// redefined in the meantime are put back over the polyfill, and a feature
+/// with none of its accessors left is not installed.
+const _lazyGlobalsJsCode = """
+var FLUTTER_JS_LAZY_GLOBALS = {};
+function FLUTTER_JS_installLazyGlobals(feature) {
+  var accessors = FLUTTER_JS_LAZY_GLOBALS[feature];
+  if (!accessors) return;
+  delete FLUTTER_JS_LAZY_GLOBALS[feature];
+  var replaced = {};
+  var pending = false;
+  Object.keys(accessors).forEach(function(name) {
+    var descriptor = Object.getOwnPropertyDescriptor(globalThis, name);
+    if (descriptor && descriptor.get === accessors[name]) {
+      delete globalThis[name];
+      pending = true;
+    } else {
+      replaced[name] = descriptor;
+    }
+  });
+  if (!pending) return;
+  sendMessage('LazyGlobal', JSON.stringify(feature));
+  Object.keys(replaced).forEach(function(name) {
+    try {
+      if (replaced[name]) {
+        Object.defineProperty(globalThis, name, replaced[name]);
+      } else {
+        delete globalThis[name];
+      }
+    } catch (e) {}
+  });
+}
+function FLUTTER_JS_defineLazyGlobals(feature, names) {
+  var accessors = FLUTTER_JS_LAZY_GLOBALS[feature] = {};
+  names.forEach(function(name) {
+    var get = accessors[name] = function() {
+      FLUTTER_JS_installLazyGlobals(feature);
+      return globalThis[name];
+    };
+    Object.defineProperty(globalThis, name, {
+      configurable: true,
+      enumerable: false,
+      get: get,
+      set: function(value) {
+        FLUTTER_JS_installLazyGlobals(feature);
+        globalThis[name] = value;
+      }
+    });
+  });
+}
+""";
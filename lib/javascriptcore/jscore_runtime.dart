@@ -102,6 +102,7 @@ class JavascriptCoreRuntime extends JavascriptRuntime {
 
   @override
   void dispose() {
+    runDisposeHooks();
     jSGlobalContextRelease(_globalContext);
     jSContextGroupRelease(_contextGroup);
   }
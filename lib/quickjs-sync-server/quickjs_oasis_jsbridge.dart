@@ -1,86 +1,216 @@
 import 'dart:async';
 import 'dart:convert';
-import 'dart:io';
 import 'dart:isolate';
-import 'dart:ui';
 
 import 'package:flutter_js/flutter_js.dart';
-import 'package:sync_http/sync_http.dart';
+import 'package:flutter_js/quickjs-sync-server/shared_memory_transport.dart';
+
+const _opEval = 1;
+const _opPendingJobs = 2;
+const _opReply = 3;
+const _opStop = 4;
+const _opResult = 16;
+const _opPromise = 17;
+const _opError = 18;
+const _opMessage = 19;
+
+/// Runs scripts on a [QuickJsRuntime2] living in a separate isolate. Calls
+/// stay synchronous: every evaluate is one frame over a
+/// [SharedMemoryTransport] and the caller blocks until the answer frame
+/// arrives. Channel messages sent by the scripts meanwhile are answered in
+/// place, so a host function may evaluate again before it returns.
+///
+/// What the scripts do between calls, channel messages from timers and
+/// settled promises, arrives through a port and is handled by this
+/// isolate's event loop.
+///
+/// A host isolate that dies fails the request waiting on it and every
+/// later one; see [failure].
+class QuickJsService extends JavascriptRuntime {
+  final SharedMemoryTransport _transport = SharedMemoryTransport.create();
 
-// ReceivePort _callDartReceivePort = new ReceivePort();
+  /// Messages and promise settlements sent by the host between requests.
+  final ReceivePort _events = ReceivePort();
 
-// void _setupCallDartPorts() {
-//   IsolateNameServer.registerPortWithName(
-//       _callDartReceivePort.sendPort, 'QuickJsServiceCallDart');
+  /// Errors and the exit of the host isolate.
+  final ReceivePort _hostStatus = ReceivePort();
 
-//   _callDartReceivePort.listen((portMessage) {
-//     final decodedMessage = (portMessage as String).split(':');
-//     int idEngine = int.parse(decodedMessage[0]);
-//     String channel = decodedMessage[1];
-//     String message = utf8.decode(base64.decode(decodedMessage[2]));
-//   });
-// }
+  /// Exit of the isolate the host waits for frames with.
+  final ReceivePort _watcherStatus = ReceivePort();
 
-class QuickJsService extends JavascriptRuntime {
-  ReceivePort _receivePort = new ReceivePort();
-  SendPort? _callServerSendPort;
+  /// Longest wait for a frame from the host before a request fails, or
+  /// null to wait as long as the host is alive. Past it the host is given
+  /// up on: the transport is hung up, the host is killed, and every later
+  /// request fails with [failure]. A request only hits it when a script runs
+  /// longer, so leave it off unless such scripts must be cut short.
+  final Duration? requestTimeout;
 
+  Isolate? _host;
+  bool _hostExited = false;
+  bool _watcherExited = false;
+  bool _transportReleased = false;
+  String? _failure;
   bool _ready = false;
-  String? _dartAddress;
+
+  /// Promises returned by evaluate, by the id the host gave them.
+  final Map<int, Completer> _promises = {};
 
   final FlutterJs _flutterJs;
 
-  QuickJsService(this._flutterJs) {
-    _startServer();
-    IsolateNameServer.registerPortWithName(
-        _receivePort.sendPort, 'QuickJsService');
+  QuickJsService(
+    this._flutterJs, {
+    this.requestTimeout,
+  }) {
+    _events.listen(_onHostEvent);
+    _hostStatus.listen((message) {
+      if (message is List) {
+        _fail('QuickJsService host failed: ${message[0]}');
+      } else {
+        _hostExited = true;
+        _fail('QuickJsService host exited');
+        _releaseTransport();
+      }
+    });
+    _watcherStatus.listen((_) {
+      _watcherExited = true;
+      _releaseTransport();
+    });
+    Isolate.spawn(
+      _quickJsServiceHost,
+      [_transport.address, _events.sendPort, _watcherStatus.sendPort],
+      debugName: 'flutter_js service ${_flutterJs.id}',
+      onError: _hostStatus.sendPort,
+      onExit: _hostStatus.sendPort,
+    ).then((isolate) {
+      _host = isolate;
+      _ready = true;
+    }, onError: (e) {
+      _hostExited = true;
+      _watcherExited = true;
+      _fail('QuickJsService host did not start: $e');
+      _releaseTransport();
+    });
     initChannelFunctions();
   }
 
   bool get isReady => _ready;
-  _startServer() async {
-    _receivePort.listen((message) async {
-      if (_dartAddress == null) {
-        _dartAddress = message;
-        _ready = true;
-        return;
-      }
-      if (_callServerSendPort == null) {
-        _callServerSendPort = message;
-      }
-    });
-    Isolate.spawn(startQuickJsServer, _receivePort.sendPort);
+
+  /// Why requests fail from now on, or null while the host is serving.
+  String? get failure => _failure;
+
+  /// Fail every pending and later request with [reason] and hang up, which
+  /// wakes the host and its doorbell watcher wherever they block on the
+  /// transport, so they wind down by themselves.
+  void _fail(String reason) {
+    _failure ??= reason;
+    for (final completer in _promises.values) {
+      completer.completeError(JsEvalResult(reason, null, isError: true));
+    }
+    _promises.clear();
+    if (!_transportReleased && !_transport.isClosed) _transport.hangUp();
+  }
+
+  /// Free the transport once neither the host nor its doorbell watcher can
+  /// touch it anymore.
+  void _releaseTransport() {
+    if (!_hostExited || !_watcherExited || _transportReleased) return;
+    _transportReleased = true;
+    _hostStatus.close();
+    _watcherStatus.close();
+    _transport.close();
   }
 
   void dispose() {
-    this._callServerSendPort!.send('STOP');
+    if (isDisposed) return;
+    runDisposeHooks();
+    if (_failure == null) _request(_opStop, const []);
+    _fail('QuickJsService was disposed');
+    _events.close();
     _flutterJs.dispose();
   }
 
+  TransportFrame _request(int op, List<int> payload) {
+    // hung up by the watcher of a host whose exit was not reported yet
+    if (_failure == null && _transport.isClosed) {
+      _fail('QuickJsService host exited');
+    }
+    final failure = _failure;
+    if (failure != null) return TransportFrame(_opError, utf8.encode(failure));
+    _transport.send(op, payload);
+    while (true) {
+      final frame = _transport.receive(timeout: requestTimeout);
+      if (frame == null) {
+        if (_transport.isClosed) {
+          _fail('QuickJsService host exited');
+        } else {
+          _fail('QuickJsService host did not answer within $requestTimeout');
+          // only takes effect once the host is back from the engine
+          _host?.kill(priority: Isolate.immediate);
+        }
+        return TransportFrame(_opError, utf8.encode(_failure!));
+      }
+      if (frame.op != _opMessage) return frame;
+      _transport.send(_opReply, _dispatchMessage(frame.payload));
+    }
+  }
+
+  void _onHostEvent(dynamic message) {
+    final List event = message;
+    switch (event[0]) {
+      case 'message':
+        _dispatchMessage(event[1]);
+        break;
+      case 'settled':
+        final completer = _promises.remove(event[1]);
+        if (completer == null) break;
+        final body = utf8.decode(event[3]);
+        dynamic value = body;
+        try {
+          value = json.decode(body);
+        } catch (e) {}
+        if (event[2] == true) {
+          completer.complete(value);
+        } else {
+          completer.completeError(JsEvalResult('$value', value, isError: true));
+        }
+        break;
+    }
+  }
+
+  List<int> _dispatchMessage(List<int> payload) {
+    dynamic result;
+    try {
+      final message = json.decode(utf8.decode(payload)) as List;
+      final fn = JavascriptRuntime
+          .channelFunctionsRegistered[getEngineInstanceId()]![message[0]];
+      result = fn?.call(message[1]);
+      return utf8.encode(json.encode(result));
+    } catch (e) {
+      if (JavascriptRuntime.debugEnabled) print('QuickJsService message: $e');
+      return utf8.encode('null');
+    }
+  }
+
   JsEvalResult evaluate(String code, {String? sourceUrl}) {
-    var request = SyncHttpClient.postUrl(new Uri.http(
-      "localhost:${FlutterJs.httpPort}",
-      "",
-      {
-        "id": _flutterJs.id.toString(),
-        "password": FlutterJs.httpPassword,
-      },
-    ));
-    request..write(code);
-    var response = request.close();
-
-    var result = response.body!;
+    final frame = _request(_opEval, utf8.encode(code));
+    final body = utf8.decode(frame.payload);
+    if (frame.op == _opPromise) {
+      // settled through [_events]; handlePromise awaits it like the future
+      // of a [QuickJsRuntime2] while it runs the pending jobs
+      final completer = _promises[int.parse(body)] = Completer();
+      final future = completer.future..catchError((_) {});
+      return JsEvalResult(future.toString(), future, isPromise: true);
+    }
+    if (frame.op != _opResult) {
+      return JsEvalResult(body, null, isError: frame.op == _opError);
+    }
 
+    dynamic result = body;
     try {
-      result = json.decode(result);
+      result = json.decode(body);
     } catch (e) {}
 
-    return JsEvalResult(
-      response.body != null && response.body!.isNotEmpty ? result : "",
-      null,
-      isPromise: response.body == 'isPromise',
-      isError: response.statusCode != 200,
-    );
+    return JsEvalResult(result is String ? result : body, result);
   }
 
   @override
@@ -106,8 +236,8 @@ class QuickJsService extends JavascriptRuntime {
 
   @override
   int executePendingJob() {
-    evaluate('(function(){})();');
-    return 0;
+    final frame = _request(_opPendingJobs, const []);
+    return int.tryParse(utf8.decode(frame.payload)) ?? 0;
   }
 
   @override
@@ -130,122 +260,223 @@ class QuickJsService extends JavascriptRuntime {
     // Nothing to do.
   }
 
+  /// Throws an [ArgumentError] when [channelName] is one of the channels
+  /// the runtime of the host keeps for itself, like `ConsoleLog`,
+  /// `SetTimeout` or `LazyGlobal`, whose messages would never get here.
   @override
   bool setupBridge(String channelName, dynamic Function(dynamic args) fn) {
-    // final channelFunctionCallbacks =
-    //     JavascriptRuntime.channelFunctionsRegistered[getEngineInstanceId()];
-    // if (channelFunctionCallbacks.keys.contains(channelName)) return false;
-
-    // channelFunctionCallbacks[channelName] = fn;
-    _flutterJs.addChannel(channelName, (args) {
-      final mapArgs = json.decode(args!);
-      final res = fn(mapArgs);
-      this.evaluate("""
-         FLUTTERJS_pendingMessages['${mapArgs['id']}'].resolve(${json.encode(res)});
-      """
-          .trim());
-      return Future.value(res);
-    }, dartChannelAddress: 'http://$_dartAddress');
-
+    final channelFunctionCallbacks =
+        JavascriptRuntime.channelFunctionsRegistered[getEngineInstanceId()]!;
+    if (channelFunctionCallbacks.keys.contains(channelName)) return false;
+
+    final result =
+        evaluate("FLUTTERJS_registerChannel(${json.encode(channelName)});");
+    if (result.isError) {
+      throw ArgumentError.value(
+          channelName, 'channelName', result.stringResult);
+    }
+    channelFunctionCallbacks[channelName] = fn;
     return true;
   }
 
   @override
   Future<JsEvalResult> evaluateAsync(String code, {String? sourceUrl}) async {
-    String strResult = await _flutterJs.eval(code);
-    return JsEvalResult(
-      strResult,
-      null,
-      isError: strResult.startsWith('ERROR:'),
-      isPromise: strResult == '[object Promise]',
-    );
+    return evaluate(code, sourceUrl: sourceUrl);
   }
 }
 
-void startQuickJsServer(SendPort sendPort) async {
-  var server = new QuickJsSyncServer();
-
-  server.serve().then((address) {
-    sendPort.send(address);
-    sendPort.send(server.dispatchSendPort);
-  });
+void _quickJsServiceHost(List args) {
+  _QuickJsServiceHost(SharedMemoryTransport.attach(args[0]), args[1])
+      .serve(args[0], args[2]);
 }
 
-class QuickJsSyncServer {
-  /// Server address
-  InternetAddress? address;
-
-  SendPort get dispatchSendPort => _dispatchPort.sendPort;
-  late ReceivePort _dispatchPort;
-
-  ReceivePort _receiveCallDartResponsePort = ReceivePort();
-
-  /// Optional server port (note: might be already taken)
-  /// Defaults to 0 (binds server to a random free port)
-  late int port;
-  late HttpServer _server;
-  SyncHttpClient? client;
-
-  QuickJsSyncServer() {
-    address = InternetAddress.loopbackIPv4;
-    port = 0;
-    _dispatchPort = new ReceivePort();
-
-    IsolateNameServer.registerPortWithName(
-      _receiveCallDartResponsePort.sendPort,
-      'ReceiveCallDartResponsePort',
-    );
+/// Engine side of a [QuickJsService]. It waits on its ports like any
+/// isolate, so the timers and promises of its runtime keep going between
+/// requests, and a [_doorbellWatcher] tells it when frames arrive.
+class _QuickJsServiceHost {
+  final SharedMemoryTransport _transport;
+  final SendPort _events;
+  final ReceivePort _wakeups = ReceivePort();
+  late final QuickJsRuntime2 _runtime;
+  late final SendPort _watcher;
+  int _depth = 0;
+  int _lastPromiseId = 0;
+  bool _stopped = false;
+
+  _QuickJsServiceHost(this._transport, this._events);
+
+  void _start() {
+    _runtime = QuickJsRuntime2();
+    _runtime.onMessage('FLUTTERJS_registerChannel', (dynamic channel) {
+      return _runtime.setupBridge(channel, (dynamic args) {
+        return json.decode(utf8.decode(_sendMessage(channel, args)));
+      });
+    });
+    _runtime.evaluate("""
+      function FLUTTERJS_registerChannel(channel) {
+        if (!sendMessage('FLUTTERJS_registerChannel', JSON.stringify(channel))) {
+          throw new Error('channel ' + channel + ' is taken by the runtime');
+        }
+      }
+    """);
+  }
 
-    _dispatchPort.listen((message) {
-      if (message == 'STOP') {
-        _server.close();
+  /// Spawn the doorbell watcher on the transport at [address], which
+  /// reports its exit to [watcherExit], and serve the frames it announces.
+  /// The runtime is only created once the watcher watches for the exit of
+  /// this isolate, so whatever happens next it does not outlive the host.
+  void serve(List<int> address, SendPort watcherExit) {
+    _wakeups.listen((message) {
+      if (message is SendPort) {
+        _watcher = message;
+        _start();
+        _watcher.send(true);
+        return;
+      }
+      while (!_stopped) {
+        final frame = _transport.receive(timeout: Duration.zero);
+        if (frame == null) {
+          // woken up by the service hanging up
+          if (_transport.isClosed) _stopped = true;
+          break;
+        }
+        _handle(frame);
+      }
+      // the watcher waits for this before it blocks on the doorbell again
+      _watcher.send(!_stopped);
+      if (_stopped) {
+        _runtime.dispose();
+        _wakeups.close();
+        _transport.close();
       }
     });
+    Isolate.spawn(
+      _doorbellWatcher,
+      [address, _wakeups.sendPort, Isolate.current.controlPort],
+      debugName: 'flutter_js service doorbell',
+      onExit: watcherExit,
+    );
   }
 
-  /// Actual port server is listening on
-  get boundPort => _server.port;
-
-  /// Starts server
-  Future<String> serve() async {
-    _server = await HttpServer.bind(this.address, this.port);
-    _server.listen(_handleReq);
-    return '${_server.address.address}:${_server.port}';
+  List<int> _sendMessage(String channel, dynamic args) {
+    final message = utf8.encode(json.encode([channel, args]));
+    // outside of a request nobody is waiting on the other side
+    if (_depth == 0 || _stopped) {
+      if (!_stopped) _events.send(['message', message]);
+      return utf8.encode('null');
+    }
+    return _call(message);
   }
 
-  _handleReq(HttpRequest request) async {
-    String path = request.requestedUri.path.replaceFirst('/', '');
+  List<int> _call(List<int> message) {
+    if (_transport.isClosed) {
+      _stopped = true;
+      return utf8.encode('null');
+    }
+    _transport.send(_opMessage, message);
+    while (true) {
+      final frame = _transport.receive();
+      if (frame == null) {
+        // hung up while the service was answering
+        _stopped = true;
+        return utf8.encode('null');
+      }
+      if (frame.op == _opReply) return frame.payload;
+      _handle(frame);
+      if (_stopped) return utf8.encode('null');
+    }
+  }
 
-    if (path == '') {
-      path = 'callDart';
+  /// Runs one request. A stop only marks the host stopped; the runtime is
+  /// disposed by [serve] once no script is running anymore.
+  void _handle(TransportFrame frame) {
+    _depth++;
+    try {
+      switch (frame.op) {
+        case _opEval:
+          _reply(_runtime.evaluate(utf8.decode(frame.payload), lazy: true));
+          break;
+        case _opPendingJobs:
+          final jobs = _runtime.executePendingJob();
+          _transport.send(_opResult, utf8.encode('$jobs'));
+          break;
+        case _opStop:
+          _stopped = true;
+          _transport.send(_opResult, const []);
+          break;
+      }
+    } catch (e) {
+      if (!_transport.isClosed) _transport.send(_opError, utf8.encode('$e'));
+    } finally {
+      _depth--;
     }
+  }
 
-    if (path == 'callDart') {
+  void _reply(JsEvalResult result) {
+    final value = result.rawResult;
+    if (result.isError) {
+      _transport.send(_opError, utf8.encode(result.stringResult));
+    } else if (value is Future) {
+      final id = ++_lastPromiseId;
+      value.then(
+        (v) => _settle(id, true, v),
+        onError: (e) => _settle(id, false, '$e'),
+      );
+      _transport.send(_opPromise, utf8.encode('$id'));
+    } else {
+      // objects stay js values and are stringified by the engine
+      List<int>? bytes;
       try {
-        // if not is eval it should be call to Dart
-        String message = await utf8.decoder.bind(request).join();
-        String? idEngine = request.uri.queryParameters['id'];
-        String? channel = request.uri.queryParameters['channel'];
-
-        final callDartPort =
-            IsolateNameServer.lookupPortByName('QuickJsServiceCallDart')!;
-
-        callDartPort
-            .send("$idEngine:$channel:${base64.encode(utf8.encode(message))}");
-
-        final result = await _receiveCallDartResponsePort.take(1).first;
-
-        var response = request.response;
-        response
-          ..contentLength = result.length
-          ..write(result)
-          ..close();
-      } catch (err) {
-        request.response
-          ..statusCode = 500
-          ..write("ERROR")
-          ..close();
+        bytes = _runtime.jsonStringifyBytes(value);
+      } catch (e) {
+        bytes = utf8.encode(json.encode(result.stringResult));
+      } finally {
+        if (value is JSObjectView) value.release();
       }
-    } else {}
+      // null and undefined both stringify to nothing
+      _transport.send(_opResult, bytes ?? utf8.encode('null'));
+    }
   }
+
+  void _settle(int id, bool fulfilled, dynamic value) {
+    if (_stopped) return;
+    List<int> bytes;
+    try {
+      bytes = utf8.encode(json.encode(value));
+    } catch (e) {
+      bytes = utf8.encode(json.encode('$value'));
+    }
+    _events.send(['settled', id, fulfilled, bytes]);
+  }
+}
+
+/// Blocks on the doorbell of a [_QuickJsServiceHost] so the host does not
+/// have to: every time it is rung it pings the host, then waits for the
+/// host to read the frames before blocking again, or to stop.
+///
+/// It also watches the host: once the host exits, or the transport is hung
+/// up, it hangs up in turn, which releases a service waiting for an answer,
+/// and exits.
+void _doorbellWatcher(List args) {
+  final transport = SharedMemoryTransport.attach(args[0]);
+  final SendPort host = args[1];
+  final replies = ReceivePort();
+  void stop() {
+    transport.hangUp();
+    replies.close();
+    transport.close();
+  }
+
+  replies.listen((keepWaiting) {
+    if (keepWaiting != true) {
+      stop();
+      return;
+    }
+    SharedMemoryTransport.waitForFrames(transport.inboundFd);
+    host.send(null);
+    // the host finds the transport closed too and stops by itself
+    if (transport.isClosed) stop();
+  });
+  Isolate(args[2]).addOnExitListener(replies.sendPort, response: false);
+  host.send(replies.sendPort);
 }
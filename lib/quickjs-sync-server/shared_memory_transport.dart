@@ -0,0 +1,429 @@
+import 'dart:ffi';
+import 'dart:io';
+import 'dart:math';
+import 'dart:typed_data';
+
+import 'package:ffi/ffi.dart';
+
+const _EFD_CLOEXEC = 0x80000;
+const _POLLIN = 0x1;
+
+/// Rings are placed after a header holding the write position and the
+/// closed flag at offset 0, the read position at offset 64, so both sides
+/// never share a line, then the ring's mutex and condition variable in 64
+/// bytes each, enough for every supported libc.
+const _ringHeader = 256;
+const _frameHeader = 8;
+
+/// Set on the op of a frame whose payload did not fit in the ring. The
+/// payload is then a native address and a length, and the receiver frees it.
+const _outOfLine = 0x80000000;
+
+/// int eventfd(unsigned int initval, int flags)
+final int Function(int, int)? _eventfd = Platform.isLinux || Platform.isAndroid
+    ? DynamicLibrary.process()
+        .lookup<NativeFunction<Int32 Function(Uint32, Int32)>>('eventfd')
+        .asFunction()
+    : null;
+
+/// int pipe(int fds[2])
+final int Function(Pointer<Int32>) _pipe = DynamicLibrary.process()
+    .lookup<NativeFunction<Int32 Function(Pointer<Int32>)>>('pipe')
+    .asFunction();
+
+/// ssize_t read(int fd, void *buf, size_t count)
+final int Function(int, Pointer<Uint8>, int) _read = DynamicLibrary.process()
+    .lookup<NativeFunction<IntPtr Function(Int32, Pointer<Uint8>, IntPtr)>>(
+        'read')
+    .asFunction();
+
+/// ssize_t write(int fd, const void *buf, size_t count)
+final int Function(int, Pointer<Uint8>, int) _write = DynamicLibrary.process()
+    .lookup<NativeFunction<IntPtr Function(Int32, Pointer<Uint8>, IntPtr)>>(
+        'write')
+    .asFunction();
+
+/// int poll(struct pollfd *fds, nfds_t nfds, int timeout)
+final int Function(Pointer<Int32>, int, int) _poll = DynamicLibrary.process()
+    .lookup<NativeFunction<Int32 Function(Pointer<Int32>, IntPtr, Int32)>>(
+        'poll')
+    .asFunction();
+
+/// int close(int fd)
+final int Function(int) _close = DynamicLibrary.process()
+    .lookup<NativeFunction<Int32 Function(Int32)>>('close')
+    .asFunction();
+
+typedef _PthreadInitNative = Int32 Function(Pointer<Void>, Pointer<Void>);
+typedef _PthreadInit = int Function(Pointer<Void>, Pointer<Void>);
+typedef _PthreadOpNative = Int32 Function(Pointer<Void>);
+typedef _PthreadOp = int Function(Pointer<Void>);
+
+/// int pthread_mutex_init(pthread_mutex_t *, const pthread_mutexattr_t *)
+final _PthreadInit _mutexInit = DynamicLibrary.process()
+    .lookup<NativeFunction<_PthreadInitNative>>('pthread_mutex_init')
+    .asFunction();
+
+/// int pthread_mutex_destroy(pthread_mutex_t *mutex)
+final _PthreadOp _mutexDestroy = DynamicLibrary.process()
+    .lookup<NativeFunction<_PthreadOpNative>>('pthread_mutex_destroy')
+    .asFunction();
+
+/// int pthread_mutex_lock(pthread_mutex_t *mutex)
+final _PthreadOp _mutexLock = DynamicLibrary.process()
+    .lookup<NativeFunction<_PthreadOpNative>>('pthread_mutex_lock')
+    .asFunction();
+
+/// int pthread_mutex_unlock(pthread_mutex_t *mutex)
+final _PthreadOp _mutexUnlock = DynamicLibrary.process()
+    .lookup<NativeFunction<_PthreadOpNative>>('pthread_mutex_unlock')
+    .asFunction();
+
+/// int pthread_cond_init(pthread_cond_t *, const pthread_condattr_t *)
+final _PthreadInit _condInit = DynamicLibrary.process()
+    .lookup<NativeFunction<_PthreadInitNative>>('pthread_cond_init')
+    .asFunction();
+
+/// int pthread_cond_destroy(pthread_cond_t *cond)
+final _PthreadOp _condDestroy = DynamicLibrary.process()
+    .lookup<NativeFunction<_PthreadOpNative>>('pthread_cond_destroy')
+    .asFunction();
+
+/// int pthread_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex)
+final _PthreadInit _condWait = DynamicLibrary.process()
+    .lookup<NativeFunction<_PthreadInitNative>>('pthread_cond_wait')
+    .asFunction();
+
+/// int pthread_cond_broadcast(pthread_cond_t *cond)
+final _PthreadOp _condBroadcast = DynamicLibrary.process()
+    .lookup<NativeFunction<_PthreadOpNative>>('pthread_cond_broadcast')
+    .asFunction();
+
+/// One frame read from a [SharedMemoryTransport].
+class TransportFrame {
+  final int op;
+  final Uint8List payload;
+
+  TransportFrame(this.op, this.payload);
+}
+
+/// Wakes the other side up after a frame was written. It is an eventfd where
+/// available and a pipe elsewhere. A ring only tells that a frame may be
+/// waiting: the ring positions, read under the ring's mutex, say whether
+/// one is, so spurious rings are harmless.
+class _Doorbell {
+  final int readFd;
+  final int writeFd;
+  final bool isCounter;
+
+  _Doorbell(this.readFd, this.writeFd, this.isCounter);
+
+  factory _Doorbell.create() {
+    final eventfd = _eventfd;
+    if (eventfd != null) {
+      final fd = eventfd(0, _EFD_CLOEXEC);
+      if (fd >= 0) return _Doorbell(fd, fd, true);
+    }
+    final fds = malloc<Int32>(2);
+    try {
+      if (_pipe(fds) != 0) {
+        throw StateError('could not create the transport doorbell');
+      }
+      return _Doorbell(fds[0], fds[1], false);
+    } finally {
+      malloc.free(fds);
+    }
+  }
+
+  void ring(Pointer<Uint8> scratch) {
+    scratch.cast<Uint64>().value = 1;
+    _write(writeFd, scratch, 8);
+  }
+
+  /// Wait at most [timeoutMillis], or for as long as it takes when it is
+  /// negative, for the bell to be rung, and reset it.
+  void take(Pointer<Uint8> scratch, int scratchLength, int timeoutMillis) {
+    if (timeoutMillis >= 0 && !_waitReadable(readFd, scratch, timeoutMillis)) {
+      return;
+    }
+    _read(readFd, scratch, isCounter ? 8 : scratchLength);
+  }
+
+  void close() {
+    _close(readFd);
+    if (writeFd != readFd) _close(writeFd);
+  }
+}
+
+/// Whether [fd] became readable within [timeoutMillis], or at all when it is
+/// negative. [scratch] holds the pollfd.
+bool _waitReadable(int fd, Pointer<Uint8> scratch, int timeoutMillis) {
+  // struct pollfd { int fd; short events; short revents; }
+  scratch.cast<Int32>().value = fd;
+  scratch.cast<Int16>()[2] = _POLLIN;
+  scratch.cast<Int16>()[3] = 0;
+  return _poll(scratch.cast(), 1, timeoutMillis) > 0;
+}
+
+/// Single producer, single consumer ring of length prefixed frames. The
+/// positions are only published and read under the ring's mutex, which
+/// orders the frame bytes written before them on weakly ordered cpus too.
+/// A writer finding the ring full waits on the condition variable, which
+/// the reader signals whenever it frees space.
+class _FrameRing {
+  final Pointer<Int64> _head;
+  final Pointer<Int64> _closed;
+  final Pointer<Int64> _tail;
+  final Pointer<Void> _mutex;
+  final Pointer<Void> _space;
+  final Uint8List _data;
+  final ByteData _view;
+
+  _FrameRing._(this._head, this._closed, this._tail, this._mutex, this._space,
+      this._data)
+      : _view = _data.buffer.asByteData(_data.offsetInBytes, _data.length);
+
+  factory _FrameRing(Pointer<Uint8> base, int capacity) => _FrameRing._(
+        base.cast<Int64>(),
+        (base + 8).cast<Int64>(),
+        (base + 64).cast<Int64>(),
+        (base + 128).cast<Void>(),
+        (base + 192).cast<Void>(),
+        (base + _ringHeader).asTypedList(capacity),
+      );
+
+  static int _frameSize(int payloadLength) =>
+      (_frameHeader + payloadLength + 7) & ~7;
+
+  int get capacity => _data.length;
+
+  /// Set up the mutex and condition variable. Only the creating side does.
+  void init() {
+    if (_mutexInit(_mutex, nullptr) != 0 || _condInit(_space, nullptr) != 0) {
+      throw StateError('could not create the transport ring');
+    }
+  }
+
+  void destroy() {
+    _condDestroy(_space);
+    _mutexDestroy(_mutex);
+  }
+
+  bool get isClosed {
+    _mutexLock(_mutex);
+    final closed = _closed.value != 0;
+    _mutexUnlock(_mutex);
+    return closed;
+  }
+
+  /// Mark the ring closed and release a writer waiting for space.
+  void close() {
+    _mutexLock(_mutex);
+    _closed.value = 1;
+    _condBroadcast(_space);
+    _mutexUnlock(_mutex);
+  }
+
+  bool get hasFrames {
+    _mutexLock(_mutex);
+    final hasFrames = _head.value != _tail.value;
+    _mutexUnlock(_mutex);
+    return hasFrames;
+  }
+
+  void write(int op, List<int> payload) {
+    final size = _frameSize(payload.length);
+    // only this side moves the head
+    final head = _head.value;
+    _mutexLock(_mutex);
+    while (capacity - (head - _tail.value) < size && _closed.value == 0) {
+      _condWait(_space, _mutex);
+    }
+    final closed = _closed.value != 0;
+    _mutexUnlock(_mutex);
+    if (closed) throw StateError('the transport was closed');
+    final offset = head % capacity;
+    _view.setUint32(offset, payload.length, Endian.host);
+    _view.setUint32(offset + 4, op, Endian.host);
+    _copyIn((offset + _frameHeader) % capacity, payload);
+    _mutexLock(_mutex);
+    _head.value = head + size;
+    _mutexUnlock(_mutex);
+  }
+
+  /// Take the next frame. Only call it after [hasFrames] said there is one.
+  TransportFrame read() {
+    // only this side moves the tail
+    final tail = _tail.value;
+    final offset = tail % capacity;
+    final length = _view.getUint32(offset, Endian.host);
+    final op = _view.getUint32(offset + 4, Endian.host);
+    final payload = _copyOut((offset + _frameHeader) % capacity, length);
+    _mutexLock(_mutex);
+    _tail.value = tail + _frameSize(length);
+    _condBroadcast(_space);
+    _mutexUnlock(_mutex);
+    return TransportFrame(op, payload);
+  }
+
+  void _copyIn(int offset, List<int> bytes) {
+    final first = bytes.length < capacity - offset
+        ? bytes.length
+        : capacity - offset;
+    _data.setRange(offset, offset + first, bytes);
+    _data.setRange(0, bytes.length - first, bytes, first);
+  }
+
+  Uint8List _copyOut(int offset, int length) {
+    final first = length < capacity - offset ? length : capacity - offset;
+    return Uint8List(length)
+      ..setRange(0, first, _data, offset)
+      ..setRange(first, length, _data);
+  }
+}
+
+/// Synchronous, binary framed channel between two isolates of the same
+/// process. Each direction is a ring in native memory paired with a
+/// doorbell; the sender writes a frame and rings, the receiver blocks on the
+/// doorbell until the ring holds frames. Either side may [hangUp], which
+/// wakes the other one up wherever it waits.
+///
+/// [SharedMemoryTransport.create] allocates both rings and owns them. Its
+/// [address] is sent to the other isolate, which joins with
+/// [SharedMemoryTransport.attach] and gets the rings swapped.
+class SharedMemoryTransport {
+  final Pointer<Uint8> _memory;
+  final _FrameRing _outbound;
+  final _FrameRing _inbound;
+  final _Doorbell _outboundBell;
+  final _Doorbell _inboundBell;
+  final bool _owner;
+
+  final Pointer<Uint8> _scratch = malloc<Uint8>(_scratchLength);
+  static const _scratchLength = 512;
+
+  bool _closed = false;
+
+  SharedMemoryTransport._(this._memory, int capacity, this._outboundBell,
+      this._inboundBell, bool swapRings, this._owner)
+      : _outbound = _FrameRing(
+            swapRings ? _memory + _ringHeader + capacity : _memory, capacity),
+        _inbound = _FrameRing(
+            swapRings ? _memory : _memory + _ringHeader + capacity, capacity);
+
+  /// [capacity] is the size of each ring in bytes, rounded up to 8. Larger
+  /// payloads than half of it are passed by address instead of copied in.
+  factory SharedMemoryTransport.create({int capacity = 1 << 20}) {
+    if (Platform.isWindows) {
+      throw UnsupportedError('SharedMemoryTransport needs a posix host');
+    }
+    capacity = (capacity + 7) & ~7;
+    final memory = calloc<Uint8>(2 * (_ringHeader + capacity));
+    final transport = SharedMemoryTransport._(memory, capacity,
+        _Doorbell.create(), _Doorbell.create(), false, true);
+    transport._outbound.init();
+    transport._inbound.init();
+    return transport;
+  }
+
+  /// Join the transport created by the isolate that sent [address].
+  factory SharedMemoryTransport.attach(List<int> address) {
+    final requestBell = _Doorbell(address[2], address[3], address[6] == 1);
+    final responseBell = _Doorbell(address[4], address[5], address[6] == 1);
+    return SharedMemoryTransport._(Pointer.fromAddress(address[0]),
+        address[1], responseBell, requestBell, true, false);
+  }
+
+  /// Everything the other isolate needs to [SharedMemoryTransport.attach].
+  List<int> get address => [
+        _memory.address,
+        _outbound.capacity,
+        _outboundBell.readFd,
+        _outboundBell.writeFd,
+        _inboundBell.readFd,
+        _inboundBell.writeFd,
+        _outboundBell.isCounter ? 1 : 0,
+      ];
+
+  /// Descriptor that turns readable while frames wait for [receive]. Pass
+  /// it to [waitForFrames] to wait for them elsewhere, e.g. in an isolate
+  /// that does nothing else, while this one keeps serving its ports.
+  int get inboundFd => _inboundBell.readFd;
+
+  /// Block until [inboundFd] of some transport is rung, for frames or a
+  /// [hangUp], without taking them. Returns false after [timeout].
+  static bool waitForFrames(int inboundFd, {Duration? timeout}) {
+    final scratch = malloc<Uint8>(8);
+    try {
+      return _waitReadable(inboundFd, scratch, timeout?.inMilliseconds ?? -1);
+    } finally {
+      malloc.free(scratch);
+    }
+  }
+
+  void send(int op, List<int> payload) {
+    if (_FrameRing._frameSize(payload.length) > _outbound.capacity ~/ 2) {
+      final copy = malloc<Uint8>(payload.length);
+      copy.asTypedList(payload.length).setAll(0, payload);
+      final ref = ByteData(16)
+        ..setInt64(0, copy.address, Endian.host)
+        ..setInt64(8, payload.length, Endian.host);
+      _outbound.write(op | _outOfLine, ref.buffer.asUint8List());
+    } else {
+      _outbound.write(op, payload);
+    }
+    _outboundBell.ring(_scratch);
+  }
+
+  /// Next frame from the other side. Blocks until one arrives, or returns
+  /// null after [timeout] or once the transport was hung up.
+  TransportFrame? receive({Duration? timeout}) {
+    final elapsed = Stopwatch()..start();
+    var waited = false;
+    while (!_inbound.hasFrames) {
+      final left = timeout == null
+          ? -1
+          : max(0, timeout.inMilliseconds - elapsed.elapsedMilliseconds);
+      if ((waited && left == 0) || _inbound.isClosed) return null;
+      _inboundBell.take(_scratch, _scratchLength, left);
+      waited = true;
+    }
+    final frame = _inbound.read();
+    if (frame.op & _outOfLine == 0) return frame;
+    final ref = ByteData.sublistView(frame.payload);
+    final data = Pointer<Uint8>.fromAddress(ref.getInt64(0, Endian.host));
+    final length = ref.getInt64(8, Endian.host);
+    final payload = Uint8List.fromList(data.asTypedList(length));
+    malloc.free(data);
+    return TransportFrame(frame.op & ~_outOfLine, payload);
+  }
+
+  /// Whether either side called [hangUp].
+  bool get isClosed => _inbound.isClosed;
+
+  /// Close the transport for both sides and ring both doorbells, so a
+  /// [receive], a [send] waiting for space or a [waitForFrames] blocked on
+  /// either side returns. Neither side may send afterwards.
+  void hangUp() {
+    if (_closed) return;
+    _outbound.close();
+    _inbound.close();
+    _outboundBell.ring(_scratch);
+    _inboundBell.ring(_scratch);
+  }
+
+  /// Release this side. The creating side also frees the rings and
+  /// doorbells, so it must close last, once nothing on the other side can
+  /// block on them anymore.
+  void close() {
+    if (_closed) return;
+    _closed = true;
+    malloc.free(_scratch);
+    if (!_owner) return;
+    _outboundBell.close();
+    _inboundBell.close();
+    _outbound.destroy();
+    _inbound.destroy();
+    calloc.free(_memory);
+  }
+}
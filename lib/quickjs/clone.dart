@@ -0,0 +1,172 @@
+part of './quickjs_runtime2.dart';
+
+/// A js value cloned out of a runtime, to be read back into another one,
+/// usually on another isolate. See [QuickJsRuntime2.defineCloneReceiver]
+/// and [QuickJsRuntime2.callWithClone].
+///
+/// Follows the structured clone algorithm: besides json data it keeps
+/// `undefined`, non-finite numbers, bigints, Date, RegExp, Map, Set, Error,
+/// array buffers, typed arrays and shared and cyclic references. Functions
+/// and symbols throw a DataCloneError.
+class JSCloneData {
+  /// The value graph, see [_cloneEncoder].
+  final String json;
+
+  /// Buffers the graph refers to by index: a [Uint8List] copy of every
+  /// ArrayBuffer and a [JSSharedMemory] for every SharedArrayBuffer.
+  final List<Object> buffers;
+
+  JSCloneData._(this.json, [this.buffers = const []]);
+
+  /// Give up the shared memory references of a clone that will not be
+  /// read.
+  void discard() {
+    for (final buffer in buffers) {
+      if (buffer is JSSharedMemory) jsDropSharedMemory(buffer);
+    }
+  }
+}
+
+/// Dart function js passes clones to, see
+/// [QuickJsRuntime2.defineCloneReceiver].
+class _CloneFunction extends JSInvokable {
+  final void Function(List args, JSCloneData data) _fn;
+  _CloneFunction(this._fn);
+
+  @override
+  invoke(List args, [thisVal]) {
+    throw JSError('TypeError: clone receivers are only called from js');
+  }
+
+  @override
+  destroy() {}
+}
+
+/// Encodes a value into `json` or `[json, kinds, ...buffers]`. Every object
+/// is a record `{t, i, v}` with its type, its index for later references
+/// `{t: 'r', i}` and its content. `kinds` has a `b` per ArrayBuffer and an
+/// `h` per SharedArrayBuffer in `buffers`.
+const _cloneEncoder = '''(value) => {
+  const ids = new Map();
+  const buffers = [];
+  let kinds = '';
+  const fail = (v) => {
+    const e = new Error(typeof v + ' could not be cloned');
+    e.name = 'DataCloneError';
+    throw e;
+  };
+  const enc = (v) => {
+    switch (typeof v) {
+      case 'undefined':
+        return {t: 'u'};
+      case 'number':
+        if (Number.isFinite(v) && !Object.is(v, -0)) return v;
+        return {t: 'n', v: Object.is(v, -0) ? '-0' : String(v)};
+      case 'bigint':
+        return {t: 'g', v: String(v)};
+      case 'string':
+      case 'boolean':
+        return v;
+      case 'function':
+      case 'symbol':
+        fail(v);
+    }
+    if (v === null) return null;
+    let i = ids.get(v);
+    if (i !== undefined) return {t: 'r', i};
+    i = ids.size;
+    ids.set(v, i);
+    const tag = Object.prototype.toString.call(v).slice(8, -1);
+    if (Array.isArray(v)) return {t: 'a', i, v: Array.from(v, enc)};
+    switch (tag) {
+      case 'Date':
+        return {t: 'd', i, v: v.getTime()};
+      case 'RegExp':
+        return {t: 'x', i, v: v.source, f: v.flags};
+      case 'Map':
+        return {t: 'm', i, v: Array.from(v, ([k, x]) => [enc(k), enc(x)])};
+      case 'Set':
+        return {t: 's', i, v: Array.from(v, enc)};
+      case 'Error':
+        return {t: 'e', i, n: v.name, v: v.message};
+      case 'Boolean':
+      case 'Number':
+      case 'String':
+        return {t: 'p', i, v: enc(v.valueOf())};
+      case 'ArrayBuffer':
+      case 'SharedArrayBuffer':
+        kinds += tag === 'ArrayBuffer' ? 'b' : 'h';
+        buffers.push(v);
+        return {t: 'b', i, v: buffers.length - 1};
+    }
+    if (ArrayBuffer.isView(v)) {
+      const length = tag === 'DataView' ? v.byteLength : v.length;
+      return {t: 'v', i, k: tag, b: enc(v.buffer), o: v.byteOffset, l: length};
+    }
+    return {t: 'o', i, v: Object.keys(v).map((k) => [k, enc(v[k])])};
+  };
+  const json = JSON.stringify(enc(value));
+  return buffers.length ? [json, kinds, ...buffers] : json;
+}''';
+
+/// Decodes the json of [_cloneEncoder], with the buffers it refers to
+/// passed after it.
+const _cloneDecoder = '''(json, ...buffers) => {
+  const refs = [];
+  const errors = {EvalError, RangeError, ReferenceError, SyntaxError,
+      TypeError, URIError};
+  const dec = (r) => {
+    if (r === null || typeof r !== 'object') return r;
+    switch (r.t) {
+      case 'u':
+        return undefined;
+      case 'n':
+        return Number(r.v);
+      case 'g':
+        return BigInt(r.v);
+      case 'r':
+        return refs[r.i];
+      case 'a': {
+        const a = refs[r.i] = [];
+        for (const x of r.v) a.push(dec(x));
+        return a;
+      }
+      case 'd':
+        return refs[r.i] = new Date(r.v);
+      case 'x':
+        return refs[r.i] = new RegExp(r.v, r.f);
+      case 'm': {
+        const m = refs[r.i] = new Map();
+        for (const [k, x] of r.v) m.set(dec(k), dec(x));
+        return m;
+      }
+      case 's': {
+        const s = refs[r.i] = new Set();
+        for (const x of r.v) s.add(dec(x));
+        return s;
+      }
+      case 'e': {
+        const e = refs[r.i] = new (errors[r.n] || Error)(r.v);
+        if (e.name !== r.n) e.name = r.n;
+        return e;
+      }
+      case 'p':
+        return refs[r.i] = Object(dec(r.v));
+      case 'b':
+        return refs[r.i] = buffers[r.v];
+      case 'v': {
+        const b = dec(r.b);
+        return refs[r.i] = new globalThis[r.k](b, r.o, r.l);
+      }
+      case 'o': {
+        const o = refs[r.i] = {};
+        for (const [k, x] of r.v) {
+          Object.defineProperty(o, k, {value: dec(x), writable: true,
+              enumerable: true, configurable: true});
+        }
+        return o;
+      }
+    }
+  };
+  return dec(JSON.parse(json));
+}''';
@@ -0,0 +1,89 @@
+part of './quickjs_runtime2.dart';
+
+/// Runs a list of recorded commands inside the engine, see
+/// [QuickJsRuntime2.execute]. Each result is recorded as `[ok, value]`;
+/// the first failing command stops the list.
+const _commandBufferDriver = """(commands) => {
+  const resolve = (path) => {
+    let val = globalThis;
+    for (const key of path) {
+      if (val === undefined || val === null) return undefined;
+      val = val[key];
+    }
+    return val;
+  };
+  const results = [];
+  for (const cmd of commands) {
+    try {
+      switch (cmd[0]) {
+        case ${JSCommandBuffer._DEFINE_GLOBAL}:
+          globalThis[cmd[1]] = cmd[2];
+          results.push([true, undefined]);
+          break;
+        case ${JSCommandBuffer._GET_PATH}:
+          results.push([true, resolve(cmd[1])]);
+          break;
+        case ${JSCommandBuffer._CALL}: {
+          const fn = resolve(cmd[1]);
+          if (typeof fn !== 'function')
+            throw new TypeError(cmd[1].join('.') + ' is not a function');
+          results.push([true, fn.apply(resolve(cmd[1].slice(0, -1)), cmd[2])]);
+          break;
+        }
+      }
+    } catch (e) {
+      results.push([false, e]);
+      break;
+    }
+  }
+  return results;
+}""";
+
+/// Engine operations recorded on the dart side and executed together by
+/// [QuickJsRuntime2.execute], so a chatty setup sequence costs one engine
+/// crossing instead of one evaluate per step.
+///
+/// Paths are lists of property keys starting at `globalThis`, e.g.
+/// `['JSON', 'stringify']`.
+class JSCommandBuffer {
+  static const _DEFINE_GLOBAL = 0;
+  static const _GET_PATH = 1;
+  static const _CALL = 2;
+  static const _EVAL = 3;
+  static const _DRAIN_JOBS = 4;
+
+  final List<List> _commands = [];
+
+  /// Number of recorded commands.
+  int get length => _commands.length;
+
+  /// Set `globalThis[name]`. Dart functions are exposed as js functions.
+  void defineGlobal(String name, dynamic value) {
+    _commands.add([_DEFINE_GLOBAL, name, value]);
+  }
+
+  /// Read the value at [path].
+  void getPath(List path) {
+    _commands.add([_GET_PATH, path]);
+  }
+
+  /// Call the function at [path] with [args], using its parent as `this`.
+  void callPath(List path, [List args = const []]) {
+    _commands.add([_CALL, path, args]);
+  }
+
+  /// Evaluate [source] as a global script, like [QuickJsRuntime2.evaluate],
+  /// so its `let`, `const` and `class` declarations stay visible to later
+  /// commands and scripts. A js `eval` would scope them to itself, so this
+  /// runs as a script of its own and ends the current batch.
+  void eval(String source) {
+    _commands.add([_EVAL, source]);
+  }
+
+  /// Run pending jobs (promise reactions) before the next command.
+  void drainJobs() {
+    _commands.add([_DRAIN_JOBS]);
+  }
+
+  void clear() => _commands.clear();
+}
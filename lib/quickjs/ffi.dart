@@ -5,11 +5,16 @@
  * @LastEditors: ekibun
  * @LastEditTime: 2020-12-02 11:14:35
  */
+import 'dart:async';
+import 'dart:convert';
 import 'dart:ffi';
 import 'dart:io';
 import 'dart:isolate';
+import 'dart:typed_data';
 import 'package:ffi/ffi.dart';
 
+import 'trace.dart';
+
 extension ListFirstWhere<T> on Iterable<T> {
   T? firstWhereOrNull(bool Function(T) test) {
     try {
@@ -68,6 +73,7 @@ abstract class JSRefLeakable {}
 class JSEvalFlag {
   static const GLOBAL = 0 << 0;
   static const MODULE = 1 << 0;
+  static const COMPILE_ONLY = 1 << 5;
 }
 
 class JSChannelType {
@@ -130,28 +136,94 @@ final DynamicLibrary _qjsLib = Platform.environment['FLUTTER_TEST'] == 'true'
                 ? DynamicLibrary.open('libfastdev_quickjs_runtime.so')
                 : DynamicLibrary.process())));
 
+/// Bindings below count their calls by symbol in [QuickJsTrace.crossings].
+/// Without [kQuickJsTrace] these return the binding itself.
+R Function() _counted0<R>(String name, R Function() fn) => kQuickJsTrace
+    ? () {
+        QuickJsTrace.crossing(name);
+        return fn();
+      }
+    : fn;
+
+R Function(A) _counted1<R, A>(String name, R Function(A) fn) => kQuickJsTrace
+    ? (a) {
+        QuickJsTrace.crossing(name);
+        return fn(a);
+      }
+    : fn;
+
+R Function(A, B) _counted2<R, A, B>(String name, R Function(A, B) fn) =>
+    kQuickJsTrace
+        ? (a, b) {
+            QuickJsTrace.crossing(name);
+            return fn(a, b);
+          }
+        : fn;
+
+R Function(A, B, C) _counted3<R, A, B, C>(
+        String name, R Function(A, B, C) fn) =>
+    kQuickJsTrace
+        ? (a, b, c) {
+            QuickJsTrace.crossing(name);
+            return fn(a, b, c);
+          }
+        : fn;
+
+R Function(A, B, C, D) _counted4<R, A, B, C, D>(
+        String name, R Function(A, B, C, D) fn) =>
+    kQuickJsTrace
+        ? (a, b, c, d) {
+            QuickJsTrace.crossing(name);
+            return fn(a, b, c, d);
+          }
+        : fn;
+
+R Function(A, B, C, D, E) _counted5<R, A, B, C, D, E>(
+        String name, R Function(A, B, C, D, E) fn) =>
+    kQuickJsTrace
+        ? (a, b, c, d, e) {
+            QuickJsTrace.crossing(name);
+            return fn(a, b, c, d, e);
+          }
+        : fn;
+
+R Function(A, B, C, D, E, F) _counted6<R, A, B, C, D, E, F>(
+        String name, R Function(A, B, C, D, E, F) fn) =>
+    kQuickJsTrace
+        ? (a, b, c, d, e, f) {
+            QuickJsTrace.crossing(name);
+            return fn(a, b, c, d, e, f);
+          }
+        : fn;
+
 /// DLLEXPORT JSValue *jsThrow(JSContext *ctx, JSValue *obj)
 final Pointer<JSValue> Function(
   Pointer<JSContext> ctx,
   Pointer<JSValue> obj,
-) jsThrow = _qjsLib
-    .lookup<
-        NativeFunction<
-            Pointer<JSValue> Function(
-              Pointer<JSContext>,
-              Pointer<JSValue>,
-            )>>('jsThrow')
-    .asFunction();
+) jsThrow = _counted2(
+    'jsThrow',
+    _qjsLib
+        .lookup<
+            NativeFunction<
+                Pointer<JSValue> Function(
+                  Pointer<JSContext>,
+                  Pointer<JSValue>,
+                )>>('jsThrow')
+        .asFunction());
 
 /// JSValue *jsEXCEPTION()
-final Pointer<JSValue> Function() jsEXCEPTION = _qjsLib
-    .lookup<NativeFunction<Pointer<JSValue> Function()>>('jsEXCEPTION')
-    .asFunction();
+final Pointer<JSValue> Function() jsEXCEPTION = _counted0(
+    'jsEXCEPTION',
+    _qjsLib
+        .lookup<NativeFunction<Pointer<JSValue> Function()>>('jsEXCEPTION')
+        .asFunction());
 
 /// JSValue *jsUNDEFINED()
-final Pointer<JSValue> Function() jsUNDEFINED = _qjsLib
-    .lookup<NativeFunction<Pointer<JSValue> Function()>>('jsUNDEFINED')
-    .asFunction();
+final Pointer<JSValue> Function() jsUNDEFINED = _counted0(
+    'jsUNDEFINED',
+    _qjsLib
+        .lookup<NativeFunction<Pointer<JSValue> Function()>>('jsUNDEFINED')
+        .asFunction());
 
 typedef _JSChannel = Pointer<JSValue> Function(
     Pointer<JSContext> ctx, int method, Pointer<JSValue> argv);
@@ -162,31 +234,442 @@ typedef _JSChannelNative = Pointer<JSValue> Function(
 final Pointer<JSRuntime> Function(
   Pointer<NativeFunction<_JSChannelNative>>,
   int,
-) _jsNewRuntime = _qjsLib
-    .lookup<
-        NativeFunction<
-            Pointer<JSRuntime> Function(
-              Pointer<NativeFunction<_JSChannelNative>>,
-              Int64,
-            )>>('jsNewRuntime')
-    .asFunction();
+) _jsNewRuntime = _counted2(
+    'jsNewRuntime',
+    _qjsLib
+        .lookup<
+            NativeFunction<
+                Pointer<JSRuntime> Function(
+                  Pointer<NativeFunction<_JSChannelNative>>,
+                  Int64,
+                )>>('jsNewRuntime')
+        .asFunction());
 
 class _RuntimeOpaque {
   final _JSChannel _channel;
-  List<JSRef> _ref = [];
+  Map<int, JSRef> _ref = {};
+  int _lastRefId = 0;
+  Set<JSValueHandle> _handles = {};
+  List<JSValueHandle> _pendingRelease = [];
+  Set<JSAtomsHandle> _atoms = {};
+  List<JSAtomsHandle> _pendingAtoms = [];
+  JSRuntimeUsage? _usage;
   final ReceivePort _port;
   int? _dartObjectClassId;
   _RuntimeOpaque(this._channel, this._port);
 
   int? get dartObjectClassId => _dartObjectClassId;
 
-  void addRef(JSRef ref) => _ref.add(ref);
+  /// Keep [ref] alive and return the id it is found by. Ids are never
+  /// reused within a runtime and never 0, so they can serve as opaque.
+  int addRef(JSRef ref) {
+    final id = ++_lastRefId;
+    _ref[id] = ref;
+    return id;
+  }
+
+  bool removeRef(int id) => _ref.remove(id) != null;
+
+  JSRef? getRef(int id) => _ref[id];
+
+  /// Live dart objects and js value handles, counted by owner type.
+  Map<String, int> get liveStats {
+    final stats = <String, int>{};
+    for (final ref in _ref.values) {
+      final type = ref.runtimeType.toString();
+      stats[type] = (stats[type] ?? 0) + 1;
+    }
+    for (final handle in _handles) {
+      stats[handle.type] = (stats[handle.type] ?? 0) + 1;
+    }
+    return stats;
+  }
+}
+
+/// Resources consumed by one runtime, see [jsEnableUsage].
+///
+/// A runtime owns a single context, and the engine allocates from one heap
+/// per runtime, so this is what a tenant that owns a runtime uses. There is
+/// no finer attribution: contexts sharing a runtime cannot be told apart by
+/// the interrupt handler nor by the heap statistics, so tenants that need
+/// separate accounting need separate runtimes. Time is
+/// measured on the outermost engine crossing only, so js calling back into
+/// dart and dart calling into js again is not counted twice.
+class JSRuntimeUsage {
+  /// Number of [jsEval] crossings.
+  int evalCount = 0;
+
+  /// Number of [jsCall] crossings.
+  int callCount = 0;
+
+  /// Number of pending jobs executed, see [jsAccountUsage].
+  int jobCount = 0;
+
+  /// Bytes of source handed to the compiler.
+  int sourceBytes = 0;
+
+  /// Time spent inside the engine, in microseconds.
+  int cpuMicros = 0;
+
+  /// Number of times the engine was interrupted for running past
+  /// [cpuQuotaMicros] or the runtime timeout.
+  int interruptCount = 0;
+
+  /// Once [cpuMicros] reaches this value, the running script is interrupted
+  /// where the engine supports it, and later evaluations and calls throw
+  /// instead of entering the engine.
+  int? cpuQuotaMicros;
+
+  /// Max time of a single outermost crossing, in microseconds. Enforced by
+  /// the interrupt handler, which replaces the one of the bridge, so it
+  /// must be set whenever the runtime was created with a timeout.
+  int? timeoutMicros;
+
+  int _crossingDepth = 0;
+  final Stopwatch _crossing = Stopwatch();
+
+  bool get quotaExceeded {
+    final quota = cpuQuotaMicros;
+    return quota != null && cpuMicros >= quota;
+  }
+
+  bool get _shouldInterrupt {
+    if (_crossingDepth == 0) return false;
+    final elapsed = _crossing.elapsedMicroseconds;
+    final timeout = timeoutMicros;
+    if (timeout != null && elapsed >= timeout) return true;
+    final quota = cpuQuotaMicros;
+    return quota != null && cpuMicros + elapsed >= quota;
+  }
+
+  void reset() {
+    evalCount = 0;
+    callCount = 0;
+    jobCount = 0;
+    sourceBytes = 0;
+    cpuMicros = 0;
+    interruptCount = 0;
+  }
+
+  @override
+  String toString() {
+    return 'JSRuntimeUsage(eval: $evalCount, call: $callCount, '
+        'jobs: $jobCount, source: ${sourceBytes}B, cpu: ${cpuMicros}us, '
+        'interrupts: $interruptCount)';
+  }
+}
+
+/// typedef int JSInterruptHandler(JSRuntime *rt, void *opaque)
+typedef _JSInterruptHandler = Int32 Function(Pointer<JSRuntime>, Pointer<Void>);
+
+/// void JS_SetInterruptHandler(JSRuntime *rt, JSInterruptHandler *cb,
+///                             void *opaque)
+///
+/// Part of the engine api rather than the bridge, so not every build
+/// exports it.
+final void Function(
+  Pointer<JSRuntime>,
+  Pointer<NativeFunction<_JSInterruptHandler>>,
+  Pointer<Void>,
+)? _jsSetInterruptHandler = _qjsLib.providesSymbol('JS_SetInterruptHandler')
+    ? _qjsLib
+        .lookup<
+            NativeFunction<
+                Void Function(
+                  Pointer<JSRuntime>,
+                  Pointer<NativeFunction<_JSInterruptHandler>>,
+                  Pointer<Void>,
+                )>>('JS_SetInterruptHandler')
+        .asFunction()
+    : null;
+
+int _interruptHandler(Pointer<JSRuntime> rt, Pointer<Void> opaque) {
+  final usage = runtimeOpaques[rt]?._usage;
+  if (usage == null || !usage._shouldInterrupt) return 0;
+  usage.interruptCount += 1;
+  return 1;
+}
+
+/// Start accounting the resources [rt] uses and return its counters.
+///
+/// Accounting is off by default, so crossings pay nothing for it. With a
+/// [cpuQuotaMicros] or [timeoutMicros] the engine polls a dart interrupt
+/// handler and aborts a script that runs past either one with an
+/// uncatchable InternalError. When the library does not export the
+/// handler, [jsCanInterrupt] is false and the quota only applies from the
+/// next crossing on.
+JSRuntimeUsage jsEnableUsage(
+  Pointer<JSRuntime> rt, {
+  int? cpuQuotaMicros,
+  int? timeoutMicros,
+}) {
+  final opaque = runtimeOpaques[rt];
+  if (opaque == null) throw Exception('Runtime has been released!');
+  final usage = opaque._usage ??= JSRuntimeUsage();
+  usage
+    ..cpuQuotaMicros = cpuQuotaMicros
+    ..timeoutMicros = timeoutMicros;
+  if (cpuQuotaMicros != null || timeoutMicros != null) {
+    _jsSetInterruptHandler?.call(
+      rt,
+      Pointer.fromFunction<_JSInterruptHandler>(_interruptHandler, 0),
+      nullptr,
+    );
+  }
+  return usage;
+}
+
+/// Whether running scripts can be interrupted, see [jsEnableUsage].
+bool get jsCanInterrupt => _jsSetInterruptHandler != null;
+
+/// Usage counters of [rt], or null unless [jsEnableUsage] was called.
+JSRuntimeUsage? jsRuntimeUsage(Pointer<JSRuntime> rt) =>
+    runtimeOpaques[rt]?._usage;
+
+/// Run [fn] as an engine crossing of [rt] and add its duration to the
+/// runtime's [JSRuntimeUsage.cpuMicros]. Just calls [fn] when accounting is
+/// off.
+T jsAccountUsage<T>(Pointer<JSRuntime> rt, T Function() fn) {
+  final usage = runtimeOpaques[rt]?._usage;
+  if (usage == null || usage._crossingDepth > 0) return fn();
+  usage._crossingDepth++;
+  usage._crossing
+    ..reset()
+    ..start();
+  try {
+    return fn();
+  } finally {
+    usage._crossingDepth--;
+    usage._crossing.stop();
+    usage.cpuMicros += usage._crossing.elapsedMicroseconds;
+  }
+}
+
+/// Throw a js error in [ctx] if its runtime has used up its cpu quota.
+/// Returns the exception value to hand back instead of entering the engine.
+Pointer<JSValue>? _checkQuota(Pointer<JSContext> ctx, JSRuntimeUsage usage) {
+  if (!usage.quotaExceeded) return null;
+  final err = jsNewError(ctx);
+  final jsKey = jsNewString(ctx, 'message');
+  final jsAtom = jsValueToAtom(ctx, jsKey);
+  jsDefinePropertyValue(
+    ctx,
+    err,
+    jsAtom,
+    jsNewString(ctx,
+        'InternalError: cpu quota of ${usage.cpuQuotaMicros}us exceeded'),
+    JSProp.C_W_E,
+  );
+  jsFreeAtom(ctx, jsAtom);
+  jsFreeValue(ctx, jsKey);
+  final ret = jsThrow(ctx, err);
+  jsFreeValue(ctx, err);
+  return ret;
+}
+
+/// The 26 int64_t counters of struct JSMemoryUsage, in declaration order.
+const _jsMemoryUsageFields = [
+  'mallocSize',
+  'mallocLimit',
+  'memoryUsedSize',
+  'mallocCount',
+  'memoryUsedCount',
+  'atomCount',
+  'atomSize',
+  'strCount',
+  'strSize',
+  'objCount',
+  'objSize',
+  'propCount',
+  'propSize',
+  'shapeCount',
+  'shapeSize',
+  'jsFuncCount',
+  'jsFuncSize',
+  'jsFuncCodeSize',
+  'jsFuncPc2lineCount',
+  'jsFuncPc2lineSize',
+  'cFuncCount',
+  'arrayCount',
+  'fastArrayCount',
+  'fastArrayElements',
+  'binaryObjectCount',
+  'binaryObjectSize',
+];
+
+/// void JS_ComputeMemoryUsage(JSRuntime *rt, JSMemoryUsage *s)
+final void Function(
+  Pointer<JSRuntime>,
+  Pointer<Int64>,
+)? _jsComputeMemoryUsage = _qjsLib.providesSymbol('JS_ComputeMemoryUsage')
+    ? _qjsLib
+        .lookup<
+            NativeFunction<
+                Void Function(
+                  Pointer<JSRuntime>,
+                  Pointer<Int64>,
+                )>>('JS_ComputeMemoryUsage')
+        .asFunction()
+    : null;
+
+/// Heap of [rt] by kind: live allocations and bytes, objects, strings,
+/// functions and so on. Walks the whole heap, so it is meant for
+/// diagnostics. Empty when the library does not export the engine's
+/// JS_ComputeMemoryUsage.
+Map<String, int> jsMemoryUsage(Pointer<JSRuntime> rt) {
+  final compute = _jsComputeMemoryUsage;
+  if (compute == null) return {};
+  final data = calloc<Int64>(_jsMemoryUsageFields.length);
+  try {
+    compute(rt, data);
+    return {
+      for (var i = 0; i < _jsMemoryUsageFields.length; ++i)
+        _jsMemoryUsageFields[i]: data[i],
+    };
+  } finally {
+    calloc.free(data);
+  }
+}
+
+/// A js value owned by a dart wrapper.
+///
+/// The value is freed by [jsReleaseValue], or, when the owner is garbage
+/// collected first, queued by a finalizer and freed in a batch by a
+/// microtask, or earlier by the next [jsEval] or [jsReleasePendingValues].
+/// Whatever is left is swept once by [jsFreeRuntime].
+class JSValueHandle {
+  final Pointer<JSRuntime> rt;
+  final Pointer<JSContext> ctx;
+  final Pointer<JSValue> val;
+  final String type;
+  bool _released = false;
+  JSValueHandle._(this.rt, this.ctx, this.val, this.type);
+
+  bool get released => _released;
+}
+
+final Finalizer<JSValueHandle> _valueFinalizer = Finalizer((handle) {
+  if (handle._released) return;
+  final opaque = runtimeOpaques[handle.rt];
+  if (opaque == null) return;
+  // finalizers run between event loop tasks, so nothing is in the engine
+  if (opaque._pendingRelease.isEmpty && opaque._pendingAtoms.isEmpty) {
+    scheduleMicrotask(() => jsReleasePendingValues(handle.rt));
+  }
+  opaque._pendingRelease.add(handle);
+});
+
+/// Atoms kept by a dart object, freed like a [JSValueHandle] when the
+/// object is garbage collected, see [jsTrackAtoms].
+class JSAtomsHandle {
+  final Pointer<JSRuntime> rt;
+  final Pointer<JSContext> ctx;
+  final List<int> atoms;
+  bool _released = false;
+  JSAtomsHandle._(this.rt, this.ctx, this.atoms);
+
+  bool get released => _released;
+}
+
+final Finalizer<JSAtomsHandle> _atomsFinalizer = Finalizer((handle) {
+  if (handle._released) return;
+  final opaque = runtimeOpaques[handle.rt];
+  if (opaque == null) return;
+  if (opaque._pendingRelease.isEmpty && opaque._pendingAtoms.isEmpty) {
+    scheduleMicrotask(() => jsReleasePendingValues(handle.rt));
+  }
+  opaque._pendingAtoms.add(handle);
+});
+
+/// Take ownership of [atoms] on behalf of [owner].
+JSAtomsHandle jsTrackAtoms(
+  Pointer<JSContext> ctx,
+  List<int> atoms,
+  Object owner,
+) {
+  final rt = jsGetRuntime(ctx);
+  final handle = JSAtomsHandle._(rt, ctx, atoms);
+  final opaque = runtimeOpaques[rt];
+  if (opaque != null) {
+    opaque._atoms.add(handle);
+    _atomsFinalizer.attach(owner, handle, detach: owner);
+  }
+  return handle;
+}
+
+/// Free the atoms of [handle] now, see [jsTrackAtoms].
+void jsReleaseAtoms(JSAtomsHandle handle, Object owner) {
+  _atomsFinalizer.detach(owner);
+  _freeAtoms(handle);
+}
 
-  bool removeRef(JSRef ref) => _ref.remove(ref);
+void _freeAtoms(JSAtomsHandle handle) {
+  if (handle._released) return;
+  handle._released = true;
+  runtimeOpaques[handle.rt]?._atoms.remove(handle);
+  for (final atom in handle.atoms) {
+    jsFreeAtom(handle.ctx, atom);
+  }
+}
 
-  JSRef? getRef(bool Function(JSRef ref) test) {
-    return _ref.firstWhereOrNull(test);
+/// Take ownership of [val] on behalf of [owner], counted as [type] in
+/// [jsLiveHandleStats].
+JSValueHandle jsTrackValue(
+  Pointer<JSContext> ctx,
+  Pointer<JSValue> val,
+  Object owner,
+  String type,
+) {
+  final rt = jsGetRuntime(ctx);
+  final handle = JSValueHandle._(rt, ctx, val, type);
+  final opaque = runtimeOpaques[rt];
+  if (opaque != null) {
+    opaque._handles.add(handle);
+    _valueFinalizer.attach(owner, handle, detach: owner);
   }
+  return handle;
+}
+
+/// Free the value of [handle] now, see [jsTrackValue].
+void jsReleaseValue(JSValueHandle handle, Object owner) {
+  _valueFinalizer.detach(owner);
+  if (handle._released) return;
+  handle._released = true;
+  runtimeOpaques[handle.rt]?._handles.remove(handle);
+  jsFreeValue(handle.ctx, handle.val);
+}
+
+/// Free the values and atoms whose owners have been garbage collected.
+/// Returns the number of values released.
+int jsReleasePendingValues(Pointer<JSRuntime> rt) {
+  final opaque = runtimeOpaques[rt];
+  if (opaque == null) return 0;
+  final atoms = opaque._pendingAtoms;
+  opaque._pendingAtoms = [];
+  for (final handle in atoms) {
+    _freeAtoms(handle);
+  }
+  if (opaque._pendingRelease.isEmpty) return 0;
+  final pending = opaque._pendingRelease;
+  opaque._pendingRelease = [];
+  final trace =
+      kQuickJsTrace ? QuickJsTrace.begin(QuickJsTraceEvent.deferredRelease) : 0;
+  var count = 0;
+  for (final handle in pending) {
+    if (handle._released) continue;
+    handle._released = true;
+    opaque._handles.remove(handle);
+    jsFreeValueRT(rt, handle.val);
+    count++;
+  }
+  if (kQuickJsTrace)
+    QuickJsTrace.end(QuickJsTraceEvent.deferredRelease, trace, bytes: count);
+  return count;
+}
+
+/// Live dart objects and js value handles of [rt], counted by owner type.
+Map<String, int> jsLiveHandleStats(Pointer<JSRuntime> rt) {
+  return runtimeOpaques[rt]?.liveStats ?? {};
 }
 
 final Map<Pointer<JSRuntime>, _RuntimeOpaque> runtimeOpaques = Map();
@@ -216,89 +699,104 @@ Pointer<JSRuntime> jsNewRuntime(
 final void Function(
   Pointer<JSRuntime>,
   int,
-) jsSetMaxStackSize = _qjsLib
-    .lookup<
-        NativeFunction<
-            Void Function(
-              Pointer<JSRuntime>,
-              IntPtr,
-            )>>('jsSetMaxStackSize')
-    .asFunction();
+) jsSetMaxStackSize = _counted2(
+    'jsSetMaxStackSize',
+    _qjsLib
+        .lookup<
+            NativeFunction<
+                Void Function(
+                  Pointer<JSRuntime>,
+                  IntPtr,
+                )>>('jsSetMaxStackSize')
+        .asFunction());
 
 /// DLLEXPORT void jsSetMemoryLimit(JSRuntime *rt, size_t limit);
 final void Function(
   Pointer<JSRuntime>,
   int,
-) jsSetMemoryLimit = _qjsLib
-    .lookup<
-        NativeFunction<
-            Void Function(
-              Pointer<JSRuntime>,
-              IntPtr,
-            )>>('jsSetMemoryLimit')
-    .asFunction();
+) jsSetMemoryLimit = _counted2(
+    'jsSetMemoryLimit',
+    _qjsLib
+        .lookup<
+            NativeFunction<
+                Void Function(
+                  Pointer<JSRuntime>,
+                  IntPtr,
+                )>>('jsSetMemoryLimit')
+        .asFunction());
 
 /// void jsFreeRuntime(JSRuntime *rt)
 final void Function(
   Pointer<JSRuntime>,
-) _jsFreeRuntime = _qjsLib
-    .lookup<
-        NativeFunction<
-            Void Function(
-              Pointer<JSRuntime>,
-            )>>('jsFreeRuntime')
-    .asFunction();
-
-void jsFreeRuntime(
+) _jsFreeRuntime = _counted1(
+    'jsFreeRuntime',
+    _qjsLib
+        .lookup<
+            NativeFunction<
+                Void Function(
+                  Pointer<JSRuntime>,
+                )>>('jsFreeRuntime')
+        .asFunction());
+
+/// Free [rt] together with everything dart still holds in it.
+/// Returns the live handle statistics found at teardown.
+Map<String, int> jsFreeRuntime(
   Pointer<JSRuntime> rt,
 ) {
-  final referenceleak = <String>[];
   final opaque = runtimeOpaques[rt];
+  var stats = <String, int>{};
   if (opaque != null) {
-    while (opaque._ref.isNotEmpty) {
-      final ref = opaque._ref.first;
+    stats = opaque.liveStats;
+    for (final ref in opaque._ref.values.toList()) {
       ref.destroy();
-      runtimeOpaques[rt]?._ref.remove(ref);
     }
-    while (opaque._ref.isNotEmpty) {
-      final ref = opaque._ref.first;
-      final objStrs = ref.toString().split('\n');
-      final objStr = objStrs.length > 0 ? objStrs[0] + " ..." : objStrs[0];
-      referenceleak.add(
-          "  ${identityHashCode(ref)}\t${ref._refCount + 1}\t${ref.runtimeType.toString()}\t$objStr");
-      ref.destroy();
+    opaque._ref.clear();
+    opaque._pendingRelease.clear();
+    // atoms go with the runtime
+    for (final handle in opaque._atoms) {
+      handle._released = true;
     }
+    opaque._atoms.clear();
+    opaque._pendingAtoms.clear();
+    for (final handle in opaque._handles) {
+      if (handle._released) continue;
+      handle._released = true;
+      jsFreeValueRT(rt, handle.val);
+    }
+    opaque._handles.clear();
   }
   _jsFreeRuntime(rt);
-  if (referenceleak.length > 0) {
-    throw ('reference leak:\n    ADDR\tREF\tTYPE\tPROP\n' +
-        referenceleak.join('\n'));
-  }
+  runtimeOpaques.remove(rt);
+  return stats;
 }
 
 /// JSValue *jsNewCFunction(JSContext *ctx, JSValue *funcData)
 final Pointer<JSValue> Function(
   Pointer<JSContext> ctx,
   Pointer<JSValue> funcData,
-) jsNewCFunction = _qjsLib
-    .lookup<
-        NativeFunction<
-            Pointer<JSValue> Function(
-              Pointer<JSContext>,
-              Pointer<JSValue>,
-            )>>('jsNewCFunction')
-    .asFunction();
+) jsNewCFunction = _counted2(
+    'jsNewCFunction',
+    _qjsLib
+        .lookup<
+            NativeFunction<
+                Pointer<JSValue> Function(
+                  Pointer<JSContext>,
+                  Pointer<JSValue>,
+                )>>('jsNewCFunction')
+        .asFunction());
 
 /// JSContext *jsNewContext(JSRuntime *rt)
 final Pointer<JSContext> Function(
   Pointer<JSRuntime> rt,
-) _jsNewContext = _qjsLib
-    .lookup<
-        NativeFunction<
-            Pointer<JSContext> Function(
-              Pointer<JSRuntime>,
-            )>>('jsNewContext')
-    .asFunction();
+) _jsNewContext = _counted1(
+    'jsNewContext',
+    _qjsLib
+        .lookup<
+            NativeFunction<
+                Pointer<JSContext> Function(
+                  Pointer<JSRuntime>,
+                )>>('jsNewContext')
+        .asFunction());
 
 Pointer<JSContext> jsNewContext(Pointer<JSRuntime> rt) {
   final ctx = _jsNewContext(rt);
@@ -312,24 +810,28 @@ Pointer<JSContext> jsNewContext(Pointer<JSRuntime> rt) {
 /// void jsFreeContext(JSContext *ctx)
 final void Function(
   Pointer<JSContext>,
-) jsFreeContext = _qjsLib
-    .lookup<
-        NativeFunction<
-            Void Function(
-              Pointer<JSContext>,
-            )>>('jsFreeContext')
-    .asFunction();
+) jsFreeContext = _counted1(
+    'jsFreeContext',
+    _qjsLib
+        .lookup<
+            NativeFunction<
+                Void Function(
+                  Pointer<JSContext>,
+                )>>('jsFreeContext')
+        .asFunction());
 
 /// JSRuntime *jsGetRuntime(JSContext *ctx)
 final Pointer<JSRuntime> Function(
   Pointer<JSContext>,
-) jsGetRuntime = _qjsLib
-    .lookup<
-        NativeFunction<
-            Pointer<JSRuntime> Function(
-              Pointer<JSContext>,
-            )>>('jsGetRuntime')
-    .asFunction();
+) jsGetRuntime = _counted1(
+    'jsGetRuntime',
+    _qjsLib
+        .lookup<
+            NativeFunction<
+                Pointer<JSRuntime> Function(
+                  Pointer<JSContext>,
+                )>>('jsGetRuntime')
+        .asFunction());
 
 /// JSValue *jsEval(JSContext *ctx, const char *input, size_t input_len, const char *filename, int eval_flags)
 final Pointer<JSValue> Function(
@@ -338,17 +840,19 @@ final Pointer<JSValue> Function(
   int inputLen,
   Pointer<Utf8> filename,
   int evalFlags,
-) _jsEval = _qjsLib
-    .lookup<
-        NativeFunction<
-            Pointer<JSValue> Function(
-              Pointer<JSContext>,
-              Pointer<Utf8>,
-              IntPtr,
-              Pointer<Utf8>,
-              Int32,
-            )>>('jsEval')
-    .asFunction();
+) _jsEval = _counted5(
+    'jsEval',
+    _qjsLib
+        .lookup<
+            NativeFunction<
+                Pointer<JSValue> Function(
+                  Pointer<JSContext>,
+                  Pointer<Utf8>,
+                  IntPtr,
+                  Pointer<Utf8>,
+                  Int32,
+                )>>('jsEval')
+        .asFunction());
 
 Pointer<JSValue> jsEval(
   Pointer<JSContext> ctx,
@@ -357,104 +861,149 @@ Pointer<JSValue> jsEval(
   int evalFlags,
 ) {
   final utf8input = input.toNativeUtf8();
-  final utf8filename = filename.toNativeUtf8();
-  final val = _jsEval(
+  final val = jsEvalUtf8(
     ctx,
-    utf8input,
+    utf8input.cast(),
     utf8input.length,
-    utf8filename,
+    filename,
     evalFlags,
   );
   malloc.free(utf8input);
+  return val;
+}
+
+/// Evaluate [inputLen] bytes of utf8 source at [input] in place.
+/// The byte at `input[inputLen]` must be readable and zero.
+Pointer<JSValue> jsEvalUtf8(
+  Pointer<JSContext> ctx,
+  Pointer<Uint8> input,
+  int inputLen,
+  String filename,
+  int evalFlags,
+) {
+  final rt = jsGetRuntime(ctx);
+  jsReleasePendingValues(rt);
+  final usage = runtimeOpaques[rt]?._usage;
+  if (usage != null) {
+    final quotaError = _checkQuota(ctx, usage);
+    if (quotaError != null) return quotaError;
+    usage
+      ..evalCount += 1
+      ..sourceBytes += inputLen;
+  }
+  final utf8filename = filename.toNativeUtf8();
+  final trace = kQuickJsTrace ? QuickJsTrace.begin(QuickJsTraceEvent.eval) : 0;
+  final val = usage == null
+      ? _jsEval(ctx, input.cast(), inputLen, utf8filename, evalFlags)
+      : jsAccountUsage(
+          rt,
+          () => _jsEval(ctx, input.cast(), inputLen, utf8filename, evalFlags),
+        );
+  if (kQuickJsTrace)
+    QuickJsTrace.end(QuickJsTraceEvent.eval, trace, bytes: inputLen);
   malloc.free(utf8filename);
-  runtimeOpaques[jsGetRuntime(ctx)]?._port.sendPort.send(#eval);
+  runtimeOpaques[rt]?._port.sendPort.send(#eval);
   return val;
 }
 
 /// DLLEXPORT int32_t jsValueGetTag(JSValue *val)
 final int Function(
   Pointer<JSValue> val,
-) jsValueGetTag = _qjsLib
-    .lookup<
-        NativeFunction<
-            Int32 Function(
-              Pointer<JSValue>,
-            )>>('jsValueGetTag')
-    .asFunction();
+) jsValueGetTag = _counted1(
+    'jsValueGetTag',
+    _qjsLib
+        .lookup<
+            NativeFunction<
+                Int32 Function(
+                  Pointer<JSValue>,
+                )>>('jsValueGetTag')
+        .asFunction());
 
 /// void *jsValueGetPtr(JSValue *val)
 final int Function(
   Pointer<JSValue> val,
-) jsValueGetPtr = _qjsLib
-    .lookup<
-        NativeFunction<
-            IntPtr Function(
-              Pointer<JSValue>,
-            )>>('jsValueGetPtr')
-    .asFunction();
+) jsValueGetPtr = _counted1(
+    'jsValueGetPtr',
+    _qjsLib
+        .lookup<
+            NativeFunction<
+                IntPtr Function(
+                  Pointer<JSValue>,
+                )>>('jsValueGetPtr')
+        .asFunction());
 
 /// DLLEXPORT bool jsTagIsFloat64(int32_t tag)
 final int Function(
   int val,
-) jsTagIsFloat64 = _qjsLib
-    .lookup<
-        NativeFunction<
-            Int32 Function(
-              Int32,
-            )>>('jsTagIsFloat64')
-    .asFunction();
+) jsTagIsFloat64 = _counted1(
+    'jsTagIsFloat64',
+    _qjsLib
+        .lookup<
+            NativeFunction<
+                Int32 Function(
+                  Int32,
+                )>>('jsTagIsFloat64')
+        .asFunction());
 
 /// JSValue *jsNewBool(JSContext *ctx, int val)
 final Pointer<JSValue> Function(
   Pointer<JSContext> ctx,
   int val,
-) jsNewBool = _qjsLib
-    .lookup<
-        NativeFunction<
-            Pointer<JSValue> Function(
-              Pointer<JSContext>,
-              Int32,
-            )>>('jsNewBool')
-    .asFunction();
+) jsNewBool = _counted2(
+    'jsNewBool',
+    _qjsLib
+        .lookup<
+            NativeFunction<
+                Pointer<JSValue> Function(
+                  Pointer<JSContext>,
+                  Int32,
+                )>>('jsNewBool')
+        .asFunction());
 
 /// JSValue *jsNewInt64(JSContext *ctx, int64_t val)
 final Pointer<JSValue> Function(
   Pointer<JSContext> ctx,
   int val,
-) jsNewInt64 = _qjsLib
-    .lookup<
-        NativeFunction<
-            Pointer<JSValue> Function(
-              Pointer<JSContext>,
-              Int64,
-            )>>('jsNewInt64')
-    .asFunction();
+) jsNewInt64 = _counted2(
+    'jsNewInt64',
+    _qjsLib
+        .lookup<
+            NativeFunction<
+                Pointer<JSValue> Function(
+                  Pointer<JSContext>,
+                  Int64,
+                )>>('jsNewInt64')
+        .asFunction());
 
 /// JSValue *jsNewFloat64(JSContext *ctx, double val)
 final Pointer<JSValue> Function(
   Pointer<JSContext> ctx,
   double val,
-) jsNewFloat64 = _qjsLib
-    .lookup<
-        NativeFunction<
-            Pointer<JSValue> Function(
-              Pointer<JSContext>,
-              Double,
-            )>>('jsNewFloat64')
-    .asFunction();
+) jsNewFloat64 = _counted2(
+    'jsNewFloat64',
+    _qjsLib
+        .lookup<
+            NativeFunction<
+                Pointer<JSValue> Function(
+                  Pointer<JSContext>,
+                  Double,
+                )>>('jsNewFloat64')
+        .asFunction());
 
 /// JSValue *jsNewString(JSContext *ctx, const char *str)
 final Pointer<JSValue> Function(
   Pointer<JSContext> ctx,
   Pointer<Utf8> str,
-) _jsNewString = _qjsLib
-    .lookup<
-        NativeFunction<
-            Pointer<JSValue> Function(
-              Pointer<JSContext>,
-              Pointer<Utf8>,
-            )>>('jsNewString')
-    .asFunction();
+) _jsNewString = _counted2(
+    'jsNewString',
+    _qjsLib
+        .lookup<
+            NativeFunction<
+                Pointer<JSValue> Function(
+                  Pointer<JSContext>,
+                  Pointer<Utf8>,
+                )>>('jsNewString')
+        .asFunction());
 
 Pointer<JSValue> jsNewString(
   Pointer<JSContext> ctx,
@@ -466,57 +1015,74 @@ Pointer<JSValue> jsNewString(
   return jsStr;
 }
 
+/// Create a js string from a NUL terminated utf8 buffer without
+/// round-tripping it through a dart string.
+Pointer<JSValue> jsNewStringFromUtf8(
+  Pointer<JSContext> ctx,
+  Pointer<Uint8> str,
+) {
+  return _jsNewString(ctx, str.cast());
+}
+
 /// JSValue *jsNewArrayBufferCopy(JSContext *ctx, const uint8_t *buf, size_t len)
 final Pointer<JSValue> Function(
   Pointer<JSContext> ctx,
   Pointer<Uint8> buf,
   int len,
-) jsNewArrayBufferCopy = _qjsLib
-    .lookup<
-        NativeFunction<
-            Pointer<JSValue> Function(
-              Pointer<JSContext>,
-              Pointer<Uint8>,
-              IntPtr,
-            )>>('jsNewArrayBufferCopy')
-    .asFunction();
+) jsNewArrayBufferCopy = _counted3(
+    'jsNewArrayBufferCopy',
+    _qjsLib
+        .lookup<
+            NativeFunction<
+                Pointer<JSValue> Function(
+                  Pointer<JSContext>,
+                  Pointer<Uint8>,
+                  IntPtr,
+                )>>('jsNewArrayBufferCopy')
+        .asFunction());
 
 /// JSValue *jsNewArray(JSContext *ctx)
 final Pointer<JSValue> Function(
   Pointer<JSContext> ctx,
-) jsNewArray = _qjsLib
-    .lookup<
-        NativeFunction<
-            Pointer<JSValue> Function(
-              Pointer<JSContext>,
-            )>>('jsNewArray')
-    .asFunction();
+) jsNewArray = _counted1(
+    'jsNewArray',
+    _qjsLib
+        .lookup<
+            NativeFunction<
+                Pointer<JSValue> Function(
+                  Pointer<JSContext>,
+                )>>('jsNewArray')
+        .asFunction());
 
 /// JSValue *jsNewObject(JSContext *ctx)
 final Pointer<JSValue> Function(
   Pointer<JSContext> ctx,
-) jsNewObject = _qjsLib
-    .lookup<
-        NativeFunction<
-            Pointer<JSValue> Function(
-              Pointer<JSContext>,
-            )>>('jsNewObject')
-    .asFunction();
+) jsNewObject = _counted1(
+    'jsNewObject',
+    _qjsLib
+        .lookup<
+            NativeFunction<
+                Pointer<JSValue> Function(
+                  Pointer<JSContext>,
+                )>>('jsNewObject')
+        .asFunction());
 
 /// void jsFreeValue(JSContext *ctx, JSValue *val, int32_t free)
 final void Function(
   Pointer<JSContext> ctx,
   Pointer<JSValue> val,
   int free,
-) _jsFreeValue = _qjsLib
-    .lookup<
-        NativeFunction<
-            Void Function(
-              Pointer<JSContext>,
-              Pointer<JSValue>,
-              Int32,
-            )>>('jsFreeValue')
-    .asFunction();
+) _jsFreeValue = _counted3(
+    'jsFreeValue',
+    _qjsLib
+        .lookup<
+            NativeFunction<
+                Void Function(
+                  Pointer<JSContext>,
+                  Pointer<JSValue>,
+                  Int32,
+                )>>('jsFreeValue')
+        .asFunction());
 
 void jsFreeValue(
   Pointer<JSContext> ctx,
@@ -531,15 +1097,17 @@ final void Function(
   Pointer<JSRuntime> rt,
   Pointer<JSValue> val,
   int free,
-) _jsFreeValueRT = _qjsLib
-    .lookup<
-        NativeFunction<
-            Void Function(
-              Pointer<JSRuntime>,
-              Pointer<JSValue>,
-              Int32,
-            )>>('jsFreeValueRT')
-    .asFunction();
+) _jsFreeValueRT = _counted3(
+    'jsFreeValueRT',
+    _qjsLib
+        .lookup<
+            NativeFunction<
+                Void Function(
+                  Pointer<JSRuntime>,
+                  Pointer<JSValue>,
+                  Int32,
+                )>>('jsFreeValueRT')
+        .asFunction());
 
 void jsFreeValueRT(
   Pointer<JSRuntime> rt,
@@ -553,92 +1121,106 @@ void jsFreeValueRT(
 final Pointer<JSValue> Function(
   Pointer<JSContext> ctx,
   Pointer<JSValue> val,
-) jsDupValue = _qjsLib
-    .lookup<
-        NativeFunction<
-            Pointer<JSValue> Function(
-              Pointer<JSContext>,
-              Pointer<JSValue>,
-            )>>('jsDupValue')
-    .asFunction();
+) jsDupValue = _counted2(
+    'jsDupValue',
+    _qjsLib
+        .lookup<
+            NativeFunction<
+                Pointer<JSValue> Function(
+                  Pointer<JSContext>,
+                  Pointer<JSValue>,
+                )>>('jsDupValue')
+        .asFunction());
 
 /// JSValue *jsDupValueRT(JSRuntime *rt, JSValue *v)
 final Pointer<JSValue> Function(
   Pointer<JSRuntime> rt,
   Pointer<JSValue> val,
-) jsDupValueRT = _qjsLib
-    .lookup<
-        NativeFunction<
-            Pointer<JSValue> Function(
-              Pointer<JSRuntime>,
-              Pointer<JSValue>,
-            )>>('jsDupValueRT')
-    .asFunction();
+) jsDupValueRT = _counted2(
+    'jsDupValueRT',
+    _qjsLib
+        .lookup<
+            NativeFunction<
+                Pointer<JSValue> Function(
+                  Pointer<JSRuntime>,
+                  Pointer<JSValue>,
+                )>>('jsDupValueRT')
+        .asFunction());
 
 /// int32_t jsToBool(JSContext *ctx, JSValueConst *val)
 final int Function(
   Pointer<JSContext> ctx,
   Pointer<JSValue> val,
-) jsToBool = _qjsLib
-    .lookup<
-        NativeFunction<
-            Int32 Function(
-              Pointer<JSContext>,
-              Pointer<JSValue>,
-            )>>('jsToBool')
-    .asFunction();
+) jsToBool = _counted2(
+    'jsToBool',
+    _qjsLib
+        .lookup<
+            NativeFunction<
+                Int32 Function(
+                  Pointer<JSContext>,
+                  Pointer<JSValue>,
+                )>>('jsToBool')
+        .asFunction());
 
 /// int64_t jsToFloat64(JSContext *ctx, JSValueConst *val)
 final int Function(
   Pointer<JSContext> ctx,
   Pointer<JSValue> val,
-) jsToInt64 = _qjsLib
-    .lookup<
-        NativeFunction<
-            Int64 Function(
-              Pointer<JSContext>,
-              Pointer<JSValue>,
-            )>>('jsToInt64')
-    .asFunction();
+) jsToInt64 = _counted2(
+    'jsToInt64',
+    _qjsLib
+        .lookup<
+            NativeFunction<
+                Int64 Function(
+                  Pointer<JSContext>,
+                  Pointer<JSValue>,
+                )>>('jsToInt64')
+        .asFunction());
 
 /// double jsToFloat64(JSContext *ctx, JSValueConst *val)
 final double Function(
   Pointer<JSContext> ctx,
   Pointer<JSValue> val,
-) jsToFloat64 = _qjsLib
-    .lookup<
-        NativeFunction<
-            Double Function(
-              Pointer<JSContext>,
-              Pointer<JSValue>,
-            )>>('jsToFloat64')
-    .asFunction();
+) jsToFloat64 = _counted2(
+    'jsToFloat64',
+    _qjsLib
+        .lookup<
+            NativeFunction<
+                Double Function(
+                  Pointer<JSContext>,
+                  Pointer<JSValue>,
+                )>>('jsToFloat64')
+        .asFunction());
 
 /// const char *jsToCString(JSContext *ctx, JSValue *val)
 final Pointer<Utf8> Function(
   Pointer<JSContext> ctx,
   Pointer<JSValue> val,
-) _jsToCString = _qjsLib
-    .lookup<
-        NativeFunction<
-            Pointer<Utf8> Function(
-              Pointer<JSContext>,
-              Pointer<JSValue>,
-            )>>('jsToCString')
-    .asFunction();
+) _jsToCString = _counted2(
+    'jsToCString',
+    _qjsLib
+        .lookup<
+            NativeFunction<
+                Pointer<Utf8> Function(
+                  Pointer<JSContext>,
+                  Pointer<JSValue>,
+                )>>('jsToCString')
+        .asFunction());
 
 /// void jsFreeCString(JSContext *ctx, const char *ptr)
 final void Function(
   Pointer<JSContext> ctx,
   Pointer<Utf8> val,
-) jsFreeCString = _qjsLib
-    .lookup<
-        NativeFunction<
-            Void Function(
-              Pointer<JSContext>,
-              Pointer<Utf8>,
-            )>>('jsFreeCString')
-    .asFunction();
+) jsFreeCString = _counted2(
+    'jsFreeCString',
+    _qjsLib
+        .lookup<
+            NativeFunction<
+                Void Function(
+                  Pointer<JSContext>,
+                  Pointer<Utf8>,
+                )>>('jsFreeCString')
+        .asFunction());
 
 String jsToCString(
   Pointer<JSContext> ctx,
@@ -646,23 +1228,40 @@ String jsToCString(
 ) {
   final ptr = _jsToCString(ctx, val);
   if (ptr.address == 0) throw Exception('JSValue cannot convert to string');
-  final str = ptr.toDartString();
+  final str = utf8.decode(ptr.cast<Uint8>().asTypedList(ptr.length),
+      allowMalformed: true);
   jsFreeCString(ctx, ptr);
   return str;
 }
 
+/// Copy the utf8 representation of [val] into a dart byte list. Lone
+/// surrogates come out as their 3 byte sequences, so decode the result
+/// with `allowMalformed`.
+Uint8List jsToUtf8Bytes(
+  Pointer<JSContext> ctx,
+  Pointer<JSValue> val,
+) {
+  final ptr = _jsToCString(ctx, val);
+  if (ptr.address == 0) throw Exception('JSValue cannot convert to string');
+  final bytes = Uint8List.fromList(ptr.cast<Uint8>().asTypedList(ptr.length));
+  jsFreeCString(ctx, ptr);
+  return bytes;
+}
+
 /// DLLEXPORT uint32_t jsNewClass(JSContext *ctx, const char *name)
 final int Function(
   Pointer<JSContext> ctx,
   Pointer<Utf8> name,
-) _jsNewClass = _qjsLib
-    .lookup<
-        NativeFunction<
-            Uint32 Function(
-              Pointer<JSContext>,
-              Pointer<Utf8>,
-            )>>('jsNewClass')
-    .asFunction();
+) _jsNewClass = _counted2(
+    'jsNewClass',
+    _qjsLib
+        .lookup<
+            NativeFunction<
+                Uint32 Function(
+                  Pointer<JSContext>,
+                  Pointer<Utf8>,
+                )>>('jsNewClass')
+        .asFunction());
 
 int jsNewClass(
   Pointer<JSContext> ctx,
@@ -682,106 +1281,122 @@ final Pointer<JSValue> Function(
   Pointer<JSContext> ctx,
   int classId,
   int opaque,
-) jsNewObjectClass = _qjsLib
-    .lookup<
-        NativeFunction<
-            Pointer<JSValue> Function(
-              Pointer<JSContext>,
-              Uint32,
-              IntPtr,
-            )>>('jsNewObjectClass')
-    .asFunction();
+) jsNewObjectClass = _counted3(
+    'jsNewObjectClass',
+    _qjsLib
+        .lookup<
+            NativeFunction<
+                Pointer<JSValue> Function(
+                  Pointer<JSContext>,
+                  Uint32,
+                  IntPtr,
+                )>>('jsNewObjectClass')
+        .asFunction());
 
 /// DLLEXPORT void *jsGetObjectOpaque(JSValue *obj, uint32_t classid)
 final int Function(
   Pointer<JSValue> obj,
   int classid,
-) jsGetObjectOpaque = _qjsLib
-    .lookup<
-        NativeFunction<
-            IntPtr Function(
-              Pointer<JSValue>,
-              Uint32,
-            )>>('jsGetObjectOpaque')
-    .asFunction();
+) jsGetObjectOpaque = _counted2(
+    'jsGetObjectOpaque',
+    _qjsLib
+        .lookup<
+            NativeFunction<
+                IntPtr Function(
+                  Pointer<JSValue>,
+                  Uint32,
+                )>>('jsGetObjectOpaque')
+        .asFunction());
 
 /// uint8_t *jsGetArrayBuffer(JSContext *ctx, size_t *psize, JSValueConst *obj)
 final Pointer<Uint8> Function(
   Pointer<JSContext> ctx,
   Pointer<IntPtr> psize,
   Pointer<JSValue> val,
-) jsGetArrayBuffer = _qjsLib
-    .lookup<
-        NativeFunction<
-            Pointer<Uint8> Function(
-              Pointer<JSContext>,
-              Pointer<IntPtr>,
-              Pointer<JSValue>,
-            )>>('jsGetArrayBuffer')
-    .asFunction();
+) jsGetArrayBuffer = _counted3(
+    'jsGetArrayBuffer',
+    _qjsLib
+        .lookup<
+            NativeFunction<
+                Pointer<Uint8> Function(
+                  Pointer<JSContext>,
+                  Pointer<IntPtr>,
+                  Pointer<JSValue>,
+                )>>('jsGetArrayBuffer')
+        .asFunction());
 
 /// int32_t jsIsFunction(JSContext *ctx, JSValueConst *val)
 final int Function(
   Pointer<JSContext> ctx,
   Pointer<JSValue> val,
-) jsIsFunction = _qjsLib
-    .lookup<
-        NativeFunction<
-            Int32 Function(
-              Pointer<JSContext>,
-              Pointer<JSValue>,
-            )>>('jsIsFunction')
-    .asFunction();
+) jsIsFunction = _counted2(
+    'jsIsFunction',
+    _qjsLib
+        .lookup<
+            NativeFunction<
+                Int32 Function(
+                  Pointer<JSContext>,
+                  Pointer<JSValue>,
+                )>>('jsIsFunction')
+        .asFunction());
 
 /// int32_t jsIsPromise(JSContext *ctx, JSValueConst *val)
 final int Function(
   Pointer<JSContext> ctx,
   Pointer<JSValue> val,
-) jsIsPromise = _qjsLib
-    .lookup<
-        NativeFunction<
-            Int32 Function(
-              Pointer<JSContext>,
-              Pointer<JSValue>,
-            )>>('jsIsPromise')
-    .asFunction();
+) jsIsPromise = _counted2(
+    'jsIsPromise',
+    _qjsLib
+        .lookup<
+            NativeFunction<
+                Int32 Function(
+                  Pointer<JSContext>,
+                  Pointer<JSValue>,
+                )>>('jsIsPromise')
+        .asFunction());
 
 /// int32_t jsIsArray(JSContext *ctx, JSValueConst *val)
 final int Function(
   Pointer<JSContext> ctx,
   Pointer<JSValue> val,
-) jsIsArray = _qjsLib
-    .lookup<
-        NativeFunction<
-            Int32 Function(
-              Pointer<JSContext>,
-              Pointer<JSValue>,
-            )>>('jsIsArray')
-    .asFunction();
+) jsIsArray = _counted2(
+    'jsIsArray',
+    _qjsLib
+        .lookup<
+            NativeFunction<
+                Int32 Function(
+                  Pointer<JSContext>,
+                  Pointer<JSValue>,
+                )>>('jsIsArray')
+        .asFunction());
 
 /// DLLEXPORT int32_t jsIsError(JSContext *ctx, JSValueConst *val);
 final int Function(
   Pointer<JSContext> ctx,
   Pointer<JSValue> val,
-) jsIsError = _qjsLib
-    .lookup<
-        NativeFunction<
-            Int32 Function(
-              Pointer<JSContext>,
-              Pointer<JSValue>,
-            )>>('jsIsError')
-    .asFunction();
+) jsIsError = _counted2(
+    'jsIsError',
+    _qjsLib
+        .lookup<
+            NativeFunction<
+                Int32 Function(
+                  Pointer<JSContext>,
+                  Pointer<JSValue>,
+                )>>('jsIsError')
+        .asFunction());
 
 /// DLLEXPORT JSValue *jsNewError(JSContext *ctx);
 final Pointer<JSValue> Function(
   Pointer<JSContext> ctx,
-) jsNewError = _qjsLib
-    .lookup<
-        NativeFunction<
-            Pointer<JSValue> Function(
-              Pointer<JSContext>,
-            )>>('jsNewError')
-    .asFunction();
+) jsNewError = _counted1(
+    'jsNewError',
+    _qjsLib
+        .lookup<
+            NativeFunction<
+                Pointer<JSValue> Function(
+                  Pointer<JSContext>,
+                )>>('jsNewError')
+        .asFunction());
 
 /// JSValue *jsGetProperty(JSContext *ctx, JSValueConst *this_obj,
 ///                           JSAtom prop)
@@ -789,15 +1404,17 @@ final Pointer<JSValue> Function(
   Pointer<JSContext> ctx,
   Pointer<JSValue> thisObj,
   int prop,
-) jsGetProperty = _qjsLib
-    .lookup<
-        NativeFunction<
-            Pointer<JSValue> Function(
-              Pointer<JSContext>,
-              Pointer<JSValue>,
-              Uint32,
-            )>>('jsGetProperty')
-    .asFunction();
+) jsGetProperty = _counted3(
+    'jsGetProperty',
+    _qjsLib
+        .lookup<
+            NativeFunction<
+                Pointer<JSValue> Function(
+                  Pointer<JSContext>,
+                  Pointer<JSValue>,
+                  Uint32,
+                )>>('jsGetProperty')
+        .asFunction());
 
 /// int jsDefinePropertyValue(JSContext *ctx, JSValueConst *this_obj,
 ///                           JSAtom prop, JSValue *val, int flags)
@@ -807,56 +1424,64 @@ final int Function(
   int prop,
   Pointer<JSValue> val,
   int flag,
-) jsDefinePropertyValue = _qjsLib
-    .lookup<
-        NativeFunction<
-            Int32 Function(
-              Pointer<JSContext>,
-              Pointer<JSValue>,
-              Uint32,
-              Pointer<JSValue>,
-              Int32,
-            )>>('jsDefinePropertyValue')
-    .asFunction();
+) jsDefinePropertyValue = _counted5(
+    'jsDefinePropertyValue',
+    _qjsLib
+        .lookup<
+            NativeFunction<
+                Int32 Function(
+                  Pointer<JSContext>,
+                  Pointer<JSValue>,
+                  Uint32,
+                  Pointer<JSValue>,
+                  Int32,
+                )>>('jsDefinePropertyValue')
+        .asFunction());
 
 /// void jsFreeAtom(JSContext *ctx, JSAtom v)
 final void Function(
   Pointer<JSContext> ctx,
   int v,
-) jsFreeAtom = _qjsLib
-    .lookup<
-        NativeFunction<
-            Void Function(
-              Pointer<JSContext>,
-              Uint32,
-            )>>('jsFreeAtom')
-    .asFunction();
+) jsFreeAtom = _counted2(
+    'jsFreeAtom',
+    _qjsLib
+        .lookup<
+            NativeFunction<
+                Void Function(
+                  Pointer<JSContext>,
+                  Uint32,
+                )>>('jsFreeAtom')
+        .asFunction());
 
 /// JSAtom jsValueToAtom(JSContext *ctx, JSValueConst *val)
 final int Function(
   Pointer<JSContext> ctx,
   Pointer<JSValue> val,
-) jsValueToAtom = _qjsLib
-    .lookup<
-        NativeFunction<
-            Uint32 Function(
-              Pointer<JSContext>,
-              Pointer<JSValue>,
-            )>>('jsValueToAtom')
-    .asFunction();
+) jsValueToAtom = _counted2(
+    'jsValueToAtom',
+    _qjsLib
+        .lookup<
+            NativeFunction<
+                Uint32 Function(
+                  Pointer<JSContext>,
+                  Pointer<JSValue>,
+                )>>('jsValueToAtom')
+        .asFunction());
 
 /// JSValue *jsAtomToValue(JSContext *ctx, JSAtom val)
 final Pointer<JSValue> Function(
   Pointer<JSContext> ctx,
   int val,
-) jsAtomToValue = _qjsLib
-    .lookup<
-        NativeFunction<
-            Pointer<JSValue> Function(
-              Pointer<JSContext>,
-              Uint32,
-            )>>('jsAtomToValue')
-    .asFunction();
+) jsAtomToValue = _counted2(
+    'jsAtomToValue',
+    _qjsLib
+        .lookup<
+            NativeFunction<
+                Pointer<JSValue> Function(
+                  Pointer<JSContext>,
+                  Uint32,
+                )>>('jsAtomToValue')
+        .asFunction());
 
 /// int jsGetOwnPropertyNames(JSContext *ctx, JSPropertyEnum **ptab,
 ///                           uint32_t *plen, JSValueConst *obj, int flags)
@@ -866,52 +1491,510 @@ final int Function(
   Pointer<Uint32> plen,
   Pointer<JSValue> obj,
   int flags,
-) jsGetOwnPropertyNames = _qjsLib
-    .lookup<
-        NativeFunction<
-            Int32 Function(
-              Pointer<JSContext>,
-              Pointer<Pointer<JSPropertyEnum>>,
-              Pointer<Uint32>,
-              Pointer<JSValue>,
-              Int32,
-            )>>('jsGetOwnPropertyNames')
-    .asFunction();
+) jsGetOwnPropertyNames = _counted5(
+    'jsGetOwnPropertyNames',
+    _qjsLib
+        .lookup<
+            NativeFunction<
+                Int32 Function(
+                  Pointer<JSContext>,
+                  Pointer<Pointer<JSPropertyEnum>>,
+                  Pointer<Uint32>,
+                  Pointer<JSValue>,
+                  Int32,
+                )>>('jsGetOwnPropertyNames')
+        .asFunction());
 
 /// JSAtom jsPropertyEnumGetAtom(JSPropertyEnum *ptab, int i)
 final int Function(
   Pointer<JSPropertyEnum> ptab,
   int i,
-) jsPropertyEnumGetAtom = _qjsLib
-    .lookup<
-        NativeFunction<
-            Uint32 Function(
-              Pointer<JSPropertyEnum>,
-              Int32,
-            )>>('jsPropertyEnumGetAtom')
-    .asFunction();
+) jsPropertyEnumGetAtom = _counted2(
+    'jsPropertyEnumGetAtom',
+    _qjsLib
+        .lookup<
+            NativeFunction<
+                Uint32 Function(
+                  Pointer<JSPropertyEnum>,
+                  Int32,
+                )>>('jsPropertyEnumGetAtom')
+        .asFunction());
 
 /// uint32_t sizeOfJSValue()
-final int Function() _sizeOfJSValue = _qjsLib
-    .lookup<NativeFunction<Uint32 Function()>>('sizeOfJSValue')
-    .asFunction();
+final int Function() _sizeOfJSValue = _counted0(
+    'sizeOfJSValue',
+    _qjsLib
+        .lookup<NativeFunction<Uint32 Function()>>('sizeOfJSValue')
+        .asFunction());
 
 final sizeOfJSValue = _sizeOfJSValue();
 
+/// A JSValue as the engine api passes it, by value. The bridge wraps every
+/// value in a heap cell instead, see [_adoptValue].
+final class _JSValueRaw extends Struct {
+  @Int64()
+  external int u;
+
+  @Int64()
+  external int tag;
+}
+
+/// The engine api is only bound where JSValue is the two word struct above,
+/// not on builds that NaN-box it into 64 bits.
+final bool _engineApi = sizeOfJSValue == sizeOf<_JSValueRaw>();
+
+/// Move [raw], returned by value from the engine api, into a heap cell
+/// owned by the bridge like every other [Pointer<JSValue>].
+Pointer<JSValue> _adoptValue(Pointer<JSContext> ctx, _JSValueRaw raw) {
+  final cell = calloc<_JSValueRaw>();
+  cell.ref
+    ..u = raw.u
+    ..tag = raw.tag;
+  final val = jsDupValue(ctx, cell.cast());
+  jsFreeValue(ctx, cell.cast(), free: false);
+  calloc.free(cell);
+  return val;
+}
+
+/// JSValue JS_ParseJSON(JSContext *ctx, const char *buf, size_t buf_len,
+///                      const char *filename)
+final _JSValueRaw Function(
+  Pointer<JSContext>,
+  Pointer<Uint8>,
+  int,
+  Pointer<Utf8>,
+)? _jsParseJSON = _engineApi && _qjsLib.providesSymbol('JS_ParseJSON')
+    ? _counted4(
+        'JS_ParseJSON',
+        _qjsLib
+            .lookup<
+                NativeFunction<
+                    _JSValueRaw Function(
+                      Pointer<JSContext>,
+                      Pointer<Uint8>,
+                      IntPtr,
+                      Pointer<Utf8>,
+                    )>>('JS_ParseJSON')
+            .asFunction())
+    : null;
+
+/// Parse [length] bytes of utf8 json at [buf], NUL bytes included, with the
+/// engine's json parser. `buf[length]` must be readable and zero. Returns
+/// null where the library does not export JS_ParseJSON.
+Pointer<JSValue>? jsParseJSON(
+  Pointer<JSContext> ctx,
+  Pointer<Uint8> buf,
+  int length,
+) {
+  final parse = _jsParseJSON;
+  if (parse == null) return null;
+  final filename = '<json>'.toNativeUtf8();
+  try {
+    return _adoptValue(ctx, parse(ctx, buf, length, filename));
+  } finally {
+    malloc.free(filename);
+  }
+}
+
+/// JSValue JS_NewArrayBuffer(JSContext *ctx, uint8_t *buf, size_t len,
+///                           JSFreeArrayBufferDataFunc *free_func,
+///                           void *opaque, JS_BOOL is_shared)
+final _JSValueRaw Function(
+  Pointer<JSContext>,
+  Pointer<Uint8>,
+  int,
+  Pointer<Void>,
+  Pointer<Void>,
+  int,
+)? _jsNewArrayBuffer = _engineApi && _qjsLib.providesSymbol('JS_NewArrayBuffer')
+    ? _counted6(
+        'JS_NewArrayBuffer',
+        _qjsLib
+            .lookup<
+                NativeFunction<
+                    _JSValueRaw Function(
+                      Pointer<JSContext>,
+                      Pointer<Uint8>,
+                      IntPtr,
+                      Pointer<Void>,
+                      Pointer<Void>,
+                      Int32,
+                    )>>('JS_NewArrayBuffer')
+            .asFunction())
+    : null;
+
+/// typedef struct JSSharedArrayBufferFunctions {
+///   void *(*sab_alloc)(void *opaque, size_t size);
+///   void (*sab_free)(void *opaque, void *ptr);
+///   void (*sab_dup)(void *opaque, void *ptr);
+///   void *sab_opaque;
+/// } JSSharedArrayBufferFunctions;
+final class _JSSharedArrayBufferFunctions extends Struct {
+  external Pointer<NativeFunction<_JSSabAlloc>> sabAlloc;
+  external Pointer<NativeFunction<_JSSabFree>> sabFree;
+  external Pointer<NativeFunction<_JSSabFree>> sabDup;
+  external Pointer<Void> sabOpaque;
+}
+
+typedef _JSSabAlloc = Pointer<Void> Function(Pointer<Void>, IntPtr);
+typedef _JSSabFree = Void Function(Pointer<Void>, Pointer<Void>);
+
+/// void JS_SetSharedArrayBufferFunctions(JSRuntime *rt,
+///     const JSSharedArrayBufferFunctions *sf)
+final void Function(
+  Pointer<JSRuntime>,
+  Pointer<_JSSharedArrayBufferFunctions>,
+)? _jsSetSharedArrayBufferFunctions =
+    _qjsLib.providesSymbol('JS_SetSharedArrayBufferFunctions')
+        ? _counted2(
+            'JS_SetSharedArrayBufferFunctions',
+            _qjsLib
+                .lookup<
+                    NativeFunction<
+                        Void Function(
+                          Pointer<JSRuntime>,
+                          Pointer<_JSSharedArrayBufferFunctions>,
+                        )>>('JS_SetSharedArrayBufferFunctions')
+                .asFunction())
+        : null;
+
+/// void JS_SetCanBlock(JSRuntime *rt, JS_BOOL can_block)
+final void Function(Pointer<JSRuntime>, int)? _jsSetCanBlock =
+    _qjsLib.providesSymbol('JS_SetCanBlock')
+        ? _counted2(
+            'JS_SetCanBlock',
+            _qjsLib
+                .lookup<NativeFunction<Void Function(Pointer<JSRuntime>, Int32)>>(
+                    'JS_SetCanBlock')
+                .asFunction())
+        : null;
+
+/// Whether SharedArrayBuffer memory can be shared between the runtimes of
+/// different isolates, see [jsEnableSharedMemory].
+bool get jsCanShareMemory =>
+    _jsNewArrayBuffer != null &&
+    _jsSetSharedArrayBufferFunctions != null &&
+    _jsSetCanBlock != null;
+
+/// Memory of a SharedArrayBuffer, passed by address to a runtime on another
+/// isolate, which wraps it with [jsAdoptSharedMemory].
+///
+/// Every instance stands for one reference to the memory, counted by the
+/// isolate that allocated it: hand it to [jsAdoptSharedMemory] or
+/// [jsDropSharedMemory] exactly once. Memory is freed when its last
+/// SharedArrayBuffer is collected, unless the allocating isolate is gone
+/// by then, in which case it stays allocated.
+class JSSharedMemory {
+  final int address;
+  final int length;
+
+  /// Port of the registry of the allocating isolate.
+  final SendPort owner;
+
+  /// Set when the reference was taken by another isolate than the owner,
+  /// which is told asynchronously, see [_SharedMemoryRegistry].
+  final Capability? token;
+
+  JSSharedMemory._(this.address, this.length, this.owner, this.token);
+}
+
+/// Reference counts of the shared memory of this isolate's runtimes.
+///
+/// Only the allocating isolate counts, since dart has no atomics on native
+/// memory. Other isolates send it `dup` before passing memory on and
+/// `release` once their buffer is collected. A `dup` can arrive after the
+/// memory it was for came back to the owner, so it carries a token and is
+/// counted only once, either by the message or by the arrival.
+class _SharedMemoryRegistry {
+  /// Memory allocated here, by address, with the references to it.
+  final Map<int, int> _owned = {};
+
+  /// Memory of other isolates used here, with the references to it.
+  final Map<int, int> _foreign = {};
+  final Map<int, SendPort> _owners = {};
+  final Set<Capability> _arrived = {};
+  final Set<Capability> _counted = {};
+  RawReceivePort? _port;
+
+  SendPort get _sendPort => (_port ??= RawReceivePort(_onMessage)).sendPort;
+
+  Pointer<Void> alloc(int size) {
+    final ptr = calloc<Uint8>(size > 0 ? size : 1);
+    _owned[ptr.address] = 1;
+    return ptr.cast();
+  }
+
+  void free(int address) {
+    if (_owned.containsKey(address)) return _unref(address);
+    final count = _foreign[address];
+    if (count == null) return;
+    final owner = _owners[address]!;
+    if (count > 1) {
+      _foreign[address] = count - 1;
+    } else {
+      _foreign.remove(address);
+      _owners.remove(address);
+    }
+    owner.send(['release', address, null]);
+  }
+
+  JSSharedMemory? share(int address, int length) {
+    if (_owned.containsKey(address)) {
+      _owned[address] = _owned[address]! + 1;
+      return JSSharedMemory._(address, length, _sendPort, null);
+    }
+    final owner = _owners[address];
+    if (owner == null) return null;
+    final token = Capability();
+    owner.send(['dup', address, token]);
+    return JSSharedMemory._(address, length, owner, token);
+  }
+
+  void adopt(JSSharedMemory memory) {
+    final address = memory.address;
+    if (_owned.containsKey(address)) return _arrive(address, memory.token);
+    _foreign[address] = (_foreign[address] ?? 0) + 1;
+    _owners[address] = memory.owner;
+  }
+
+  void drop(JSSharedMemory memory) {
+    if (_owned.containsKey(memory.address)) {
+      _arrive(memory.address, memory.token);
+      _unref(memory.address);
+    } else {
+      memory.owner.send(['release', memory.address, memory.token]);
+    }
+  }
+
+  void _arrive(int address, Capability? token) {
+    if (token == null || _counted.remove(token)) return;
+    _arrived.add(token);
+    _owned[address] = _owned[address]! + 1;
+  }
+
+  void _unref(int address) {
+    final count = _owned[address]! - 1;
+    if (count > 0) {
+      _owned[address] = count;
+      return;
+    }
+    _owned.remove(address);
+    calloc.free(Pointer<Uint8>.fromAddress(address));
+    if (_owned.isEmpty) {
+      _port?.close();
+      _port = null;
+    }
+  }
+
+  void _onMessage(dynamic message) {
+    final int address = message[1];
+    final Capability? token = message[2];
+    if (!_owned.containsKey(address)) return;
+    switch (message[0]) {
+      case 'dup':
+        if (_arrived.remove(token)) return;
+        _counted.add(token!);
+        _owned[address] = _owned[address]! + 1;
+        break;
+      case 'release':
+        _arrive(address, token);
+        _unref(address);
+        break;
+    }
+  }
+}
+
+final _sharedMemory = _SharedMemoryRegistry();
+
+Pointer<Void> _sabAlloc(Pointer<Void> opaque, int size) =>
+    _sharedMemory.alloc(size);
+
+void _sabFree(Pointer<Void> opaque, Pointer<Void> ptr) =>
+    _sharedMemory.free(ptr.address);
+
+/// References are taken by [JSSharedMemory] before a buffer is wrapped.
+void _sabDup(Pointer<Void> opaque, Pointer<Void> ptr) {}
+
+/// Allocate the SharedArrayBuffers of [rt] so they can be shared with
+/// runtimes on other isolates, and let `Atomics.wait` block if [canBlock].
+/// Returns false where the library lacks the api, see [jsCanShareMemory];
+/// SharedArrayBuffers are then local to their runtime.
+///
+/// Must be called before the runtime allocates its first SharedArrayBuffer.
+bool jsEnableSharedMemory(Pointer<JSRuntime> rt, {required bool canBlock}) {
+  if (!jsCanShareMemory) return false;
+  final functions = calloc<_JSSharedArrayBufferFunctions>();
+  functions.ref
+    ..sabAlloc = Pointer.fromFunction<_JSSabAlloc>(_sabAlloc)
+    ..sabFree = Pointer.fromFunction<_JSSabFree>(_sabFree)
+    ..sabDup = Pointer.fromFunction<_JSSabFree>(_sabDup)
+    ..sabOpaque = nullptr;
+  _jsSetSharedArrayBufferFunctions!(rt, functions);
+  calloc.free(functions);
+  _jsSetCanBlock!(rt, canBlock ? 1 : 0);
+  return true;
+}
+
+/// Take a reference to the shared memory at [buf] for another isolate, or
+/// return null if it was not allocated through [jsEnableSharedMemory].
+JSSharedMemory? jsShareMemory(Pointer<Uint8> buf, int length) =>
+    _sharedMemory.share(buf.address, length);
+
+/// Wrap [memory] in a SharedArrayBuffer of [ctx], which takes over its
+/// reference. The runtime must have shared memory enabled.
+Pointer<JSValue> jsAdoptSharedMemory(
+  Pointer<JSContext> ctx,
+  JSSharedMemory memory,
+) {
+  _sharedMemory.adopt(memory);
+  return _adoptValue(
+    ctx,
+    _jsNewArrayBuffer!(
+      ctx,
+      Pointer.fromAddress(memory.address),
+      memory.length,
+      nullptr,
+      nullptr,
+      1,
+    ),
+  );
+}
+
+/// Give up the reference of [memory] without using it.
+void jsDropSharedMemory(JSSharedMemory memory) => _sharedMemory.drop(memory);
+
+/// JSValue JS_ReadObject(JSContext *ctx, const uint8_t *buf, size_t buf_len,
+///                       int flags)
+final _JSValueRaw Function(Pointer<JSContext>, Pointer<Uint8>, int, int)?
+    _jsReadObject = _engineApi && _qjsLib.providesSymbol('JS_ReadObject')
+        ? _counted4(
+            'JS_ReadObject',
+            _qjsLib
+                .lookup<
+                    NativeFunction<
+                        _JSValueRaw Function(
+                          Pointer<JSContext>,
+                          Pointer<Uint8>,
+                          IntPtr,
+                          Int32,
+                        )>>('JS_ReadObject')
+                .asFunction())
+        : null;
+
+/// uint8_t *JS_WriteObject(JSContext *ctx, size_t *psize, JSValueConst obj,
+///                         int flags)
+final Pointer<Uint8> Function(
+  Pointer<JSContext>,
+  Pointer<IntPtr>,
+  _JSValueRaw,
+  int,
+)? _jsWriteObject = _engineApi && _qjsLib.providesSymbol('JS_WriteObject')
+    ? _counted4(
+        'JS_WriteObject',
+        _qjsLib
+            .lookup<
+                NativeFunction<
+                    Pointer<Uint8> Function(
+                      Pointer<JSContext>,
+                      Pointer<IntPtr>,
+                      _JSValueRaw,
+                      Int32,
+                    )>>('JS_WriteObject')
+            .asFunction())
+    : null;
+
+/// JSValue JS_EvalFunction(JSContext *ctx, JSValue fun_obj)
+///
+/// Takes over the reference of fun_obj.
+final _JSValueRaw Function(Pointer<JSContext>, _JSValueRaw)? _jsEvalFunction =
+    _engineApi && _qjsLib.providesSymbol('JS_EvalFunction')
+        ? _counted2(
+            'JS_EvalFunction',
+            _qjsLib
+                .lookup<
+                    NativeFunction<
+                        _JSValueRaw Function(
+                          Pointer<JSContext>,
+                          _JSValueRaw,
+                        )>>('JS_EvalFunction')
+                .asFunction())
+        : null;
+
+/// JS_READ_OBJ_BYTECODE and JS_WRITE_OBJ_BYTECODE
+const _objBytecode = 1 << 0;
+
+/// Whether scripts can be compiled to and evaluated from bytecode, see
+/// [jsWriteBytecode] and [jsEvalBytecode].
+bool get jsCanEvalBytecode =>
+    _jsReadObject != null && _jsWriteObject != null && _jsEvalFunction != null;
+
+/// Serialize [fn], a script compiled with [JSEvalFlag.COMPILE_ONLY], to
+/// bytecode. Returns null with an exception pending in [ctx] on failure.
+Uint8List? jsWriteBytecode(Pointer<JSContext> ctx, Pointer<JSValue> fn) {
+  final psize = malloc<IntPtr>();
+  final buf = _jsWriteObject!(
+    ctx,
+    psize,
+    fn.cast<_JSValueRaw>().ref,
+    _objBytecode,
+  );
+  final size = psize.value;
+  malloc.free(psize);
+  if (buf.address == 0) return null;
+  final bytes = Uint8List.fromList(buf.asTypedList(size));
+  jsFree(ctx, buf.cast());
+  return bytes;
+}
+
+/// Evaluate [length] bytes of bytecode at [buf], written by
+/// [jsWriteBytecode] with the same library. Accounted like [jsEvalUtf8].
+///
+/// The engine trusts bytecode: loading bytes that it did not write itself
+/// can corrupt memory.
+Pointer<JSValue> jsEvalBytecode(
+  Pointer<JSContext> ctx,
+  Pointer<Uint8> buf,
+  int length,
+) {
+  final rt = jsGetRuntime(ctx);
+  jsReleasePendingValues(rt);
+  final usage = runtimeOpaques[rt]?._usage;
+  if (usage != null) {
+    final quotaError = _checkQuota(ctx, usage);
+    if (quotaError != null) return quotaError;
+    usage.evalCount += 1;
+  }
+  _JSValueRaw run() {
+    final fn = _jsReadObject!(ctx, buf, length, _objBytecode);
+    if (fn.tag == JSTag.EXCEPTION) return fn;
+    return _jsEvalFunction!(ctx, fn);
+  }
+
+  final trace = kQuickJsTrace ? QuickJsTrace.begin(QuickJsTraceEvent.eval) : 0;
+  final raw = usage == null ? run() : jsAccountUsage(rt, run);
+  final val = _adoptValue(ctx, raw);
+  if (kQuickJsTrace)
+    QuickJsTrace.end(QuickJsTraceEvent.eval, trace, bytes: length);
+  runtimeOpaques[rt]?._port.sendPort.send(#eval);
+  return val;
+}
+
 /// void setJSValueList(JSValue *list, int i, JSValue *val)
 final void Function(
   Pointer<JSValue> list,
   int i,
   Pointer<JSValue> val,
-) setJSValueList = _qjsLib
-    .lookup<
-        NativeFunction<
-            Void Function(
-              Pointer<JSValue>,
-              Uint32,
-              Pointer<JSValue>,
-            )>>('setJSValueList')
-    .asFunction();
+) setJSValueList = _counted3(
+    'setJSValueList',
+    _qjsLib
+        .lookup<
+            NativeFunction<
+                Void Function(
+                  Pointer<JSValue>,
+                  Uint32,
+                  Pointer<JSValue>,
+                )>>('setJSValueList')
+        .asFunction());
 
 /// JSValue *jsCall(JSContext *ctx, JSValueConst *func_obj, JSValueConst *this_obj,
 ///                 int argc, JSValueConst *argv)
@@ -921,17 +2004,19 @@ final Pointer<JSValue> Function(
   Pointer<JSValue> thisObj,
   int argc,
   Pointer<JSValue> argv,
-) _jsCall = _qjsLib
-    .lookup<
-        NativeFunction<
-            Pointer<JSValue> Function(
-              Pointer<JSContext>,
-              Pointer<JSValue>,
-              Pointer<JSValue>,
-              Int32,
-              Pointer<JSValue>,
-            )>>('jsCall')
-    .asFunction();
+) _jsCall = _counted5(
+    'jsCall',
+    _qjsLib
+        .lookup<
+            NativeFunction<
+                Pointer<JSValue> Function(
+                  Pointer<JSContext>,
+                  Pointer<JSValue>,
+                  Pointer<JSValue>,
+                  Int32,
+                  Pointer<JSValue>,
+                )>>('jsCall')
+        .asFunction());
 
 Pointer<JSValue> jsCall(
   Pointer<JSContext> ctx,
@@ -939,6 +2024,13 @@ Pointer<JSValue> jsCall(
   Pointer<JSValue> thisObj,
   List<Pointer<JSValue>> argv,
 ) {
+  final rt = jsGetRuntime(ctx);
+  final usage = runtimeOpaques[rt]?._usage;
+  if (usage != null) {
+    final quotaError = _checkQuota(ctx, usage);
+    if (quotaError != null) return quotaError;
+    usage.callCount += 1;
+  }
   final jsArgs = calloc<Uint8>(
     argv.length > 0 ? sizeOfJSValue * argv.length : 1,
   ).cast<JSValue>();
@@ -948,68 +2040,85 @@ Pointer<JSValue> jsCall(
   }
   final func1 = jsDupValue(ctx, funcObj);
   final _thisObj = thisObj;
-  final jsRet = _jsCall(ctx, funcObj, _thisObj, argv.length, jsArgs);
+  final trace = kQuickJsTrace ? QuickJsTrace.begin(QuickJsTraceEvent.call) : 0;
+  final jsRet = usage == null
+      ? _jsCall(ctx, funcObj, _thisObj, argv.length, jsArgs)
+      : jsAccountUsage(
+          rt,
+          () => _jsCall(ctx, funcObj, _thisObj, argv.length, jsArgs),
+        );
+  if (kQuickJsTrace) QuickJsTrace.end(QuickJsTraceEvent.call, trace);
   jsFreeValue(ctx, func1);
   malloc.free(jsArgs);
-  runtimeOpaques[jsGetRuntime(ctx)]?._port.sendPort.send(#call);
+  runtimeOpaques[rt]?._port.sendPort.send(#call);
   return jsRet;
 }
 
 /// int jsIsException(JSValueConst *val)
 final int Function(
   Pointer<JSValue> val,
-) jsIsException = _qjsLib
-    .lookup<
-        NativeFunction<
-            Int32 Function(
-              Pointer<JSValue>,
-            )>>('jsIsException')
-    .asFunction();
+) jsIsException = _counted1(
+    'jsIsException',
+    _qjsLib
+        .lookup<
+            NativeFunction<
+                Int32 Function(
+                  Pointer<JSValue>,
+                )>>('jsIsException')
+        .asFunction());
 
 /// JSValue *jsGetException(JSContext *ctx)
 final Pointer<JSValue> Function(
   Pointer<JSContext> ctx,
-) jsGetException = _qjsLib
-    .lookup<
-        NativeFunction<
-            Pointer<JSValue> Function(
-              Pointer<JSContext>,
-            )>>('jsGetException')
-    .asFunction();
+) jsGetException = _counted1(
+    'jsGetException',
+    _qjsLib
+        .lookup<
+            NativeFunction<
+                Pointer<JSValue> Function(
+                  Pointer<JSContext>,
+                )>>('jsGetException')
+        .asFunction());
 
 /// int jsExecutePendingJob(JSRuntime *rt)
 final int Function(
   Pointer<JSRuntime> ctx,
-) jsExecutePendingJob = _qjsLib
-    .lookup<
-        NativeFunction<
-            Int32 Function(
-              Pointer<JSRuntime>,
-            )>>('jsExecutePendingJob')
-    .asFunction();
+) jsExecutePendingJob = _counted1(
+    'jsExecutePendingJob',
+    _qjsLib
+        .lookup<
+            NativeFunction<
+                Int32 Function(
+                  Pointer<JSRuntime>,
+                )>>('jsExecutePendingJob')
+        .asFunction());
 
 /// JSValue *jsNewPromiseCapability(JSContext *ctx, JSValue *resolving_funcs)
 final Pointer<JSValue> Function(
   Pointer<JSContext> ctx,
   Pointer<JSValue> resolvingFuncs,
-) jsNewPromiseCapability = _qjsLib
-    .lookup<
-        NativeFunction<
-            Pointer<JSValue> Function(
-              Pointer<JSContext>,
-              Pointer<JSValue>,
-            )>>('jsNewPromiseCapability')
-    .asFunction();
+) jsNewPromiseCapability = _counted2(
+    'jsNewPromiseCapability',
+    _qjsLib
+        .lookup<
+            NativeFunction<
+                Pointer<JSValue> Function(
+                  Pointer<JSContext>,
+                  Pointer<JSValue>,
+                )>>('jsNewPromiseCapability')
+        .asFunction());
 
 /// void jsFree(JSContext *ctx, void *ptab)
 final void Function(
   Pointer<JSContext> ctx,
   Pointer<JSPropertyEnum> ptab,
-) jsFree = _qjsLib
-    .lookup<
-        NativeFunction<
-            Void Function(
-              Pointer<JSContext>,
-              Pointer<JSPropertyEnum>,
-            )>>('jsFree')
-    .asFunction();
+) jsFree = _counted2(
+    'jsFree',
+    _qjsLib
+        .lookup<
+            NativeFunction<
+                Void Function(
+                  Pointer<JSContext>,
+                  Pointer<JSPropertyEnum>,
+                )>>('jsFree')
+        .asFunction());
@@ -0,0 +1,61 @@
+part of './quickjs_runtime2.dart';
+
+/// Chunked utf8 json input for [QuickJsRuntime2.jsonParseSink].
+///
+/// Chunks are appended to a single native buffer as they arrive, so a large
+/// document never exists as a dart string nor as a second NUL terminated copy.
+/// The buffer is handed to the engine's json parser on [close].
+class JSONBytesSink implements Sink<List<int>> {
+  final QuickJsRuntime2 _runtime;
+  Pointer<Uint8>? _buf;
+  int _capacity;
+  int _length = 0;
+
+  JSONBytesSink._(this._runtime, [int initialCapacity = 4096])
+      : _capacity = initialCapacity > 0 ? initialCapacity : 1 {
+    _buf = nullTerminatedCopy(const [], _capacity);
+  }
+
+  /// Number of bytes received so far.
+  int get length => _length;
+
+  @override
+  void add(List<int> chunk) {
+    if (_buf == null) throw StateError('JSONBytesSink is closed');
+    _reserve(_length + chunk.length + 1);
+    _buf!.asTypedList(_capacity)
+      ..setAll(_length, chunk)
+      ..[_length + chunk.length] = 0;
+    _length += chunk.length;
+  }
+
+  void _reserve(int size) {
+    if (size <= _capacity) return;
+    var capacity = _capacity * 2;
+    while (capacity < size) capacity *= 2;
+    final buf = nullTerminatedCopy(_buf!.asTypedList(_length), capacity);
+    malloc.free(_buf!);
+    _buf = buf;
+    _capacity = capacity;
+  }
+
+  /// Parse the received bytes and release the native buffer.
+  @override
+  JsEvalResult close() {
+    if (_buf == null) throw StateError('JSONBytesSink is closed');
+    try {
+      return _runtime._jsonParseUtf8(_buf!, _length);
+    } finally {
+      _release();
+    }
+  }
+
+  /// Drop the received bytes without parsing them.
+  void abort() => _release();
+
+  void _release() {
+    final buf = _buf;
+    _buf = null;
+    if (buf != null) malloc.free(buf);
+  }
+}
@@ -0,0 +1,122 @@
+import 'dart:ffi';
+import 'dart:io';
+import 'dart:typed_data';
+
+import 'package:ffi/ffi.dart';
+
+const _O_RDONLY = 0;
+const _PROT_READ = 1;
+const _MAP_PRIVATE = 2;
+
+/// Smallest page size of the supported platforms. A file whose size is not a
+/// multiple of it ends inside a zero filled page once mapped.
+const _minPageSize = 4096;
+
+/// int open(const char *path, int flags)
+final int Function(Pointer<Utf8>, int) _open = DynamicLibrary.process()
+    .lookup<NativeFunction<Int32 Function(Pointer<Utf8>, Int32)>>('open')
+    .asFunction();
+
+/// int close(int fd)
+final int Function(int) _close = DynamicLibrary.process()
+    .lookup<NativeFunction<Int32 Function(Int32)>>('close')
+    .asFunction();
+
+/// void *mmap(void *addr, size_t len, int prot, int flags, int fd, off_t off)
+final Pointer<Uint8> Function(Pointer<Void>, int, int, int, int, int) _mmap =
+    DynamicLibrary.process()
+        .lookup<
+            NativeFunction<
+                Pointer<Uint8> Function(
+                  Pointer<Void>,
+                  IntPtr,
+                  Int32,
+                  Int32,
+                  Int32,
+                  IntPtr,
+                )>>('mmap')
+        .asFunction();
+
+/// int munmap(void *addr, size_t len)
+final int Function(Pointer<Uint8>, int) _munmap = DynamicLibrary.process()
+    .lookup<NativeFunction<Int32 Function(Pointer<Uint8>, IntPtr)>>('munmap')
+    .asFunction();
+
+/// Copy [bytes] into a new malloc'd buffer of at least [capacity] bytes,
+/// followed by the NUL byte the engine expects after utf8 input. Free it with
+/// `malloc.free`.
+Pointer<Uint8> nullTerminatedCopy(List<int> bytes, [int capacity = 0]) {
+  final size = capacity > bytes.length ? capacity : bytes.length + 1;
+  final data = malloc<Uint8>(size);
+  data.asTypedList(size)
+    ..setAll(0, bytes)
+    ..[bytes.length] = 0;
+  return data;
+}
+
+/// Read only, NUL terminated view of a file for the script compiler.
+///
+/// On posix systems the file is memory mapped whenever the page tail can
+/// serve as terminator, so the source is never copied. Otherwise it is read
+/// once into a native buffer. Call [close] as soon as the source has been
+/// compiled.
+///
+/// A mapping does not pin the file contents: if the file is truncated while
+/// mapped, reading past its new end raises SIGBUS and kills the process.
+/// Replacing a file by renaming a new one over it is safe, since the
+/// mapping keeps the old inode. Open files that may be truncated in place
+/// with `map: false`.
+class MappedFile {
+  /// File contents, followed by a zero byte at `data[length]`.
+  final Pointer<Uint8> data;
+
+  /// Size of the file in bytes.
+  final int length;
+
+  /// Whether [data] is a memory mapping rather than a heap copy.
+  final bool isMapped;
+
+  bool _closed = false;
+
+  MappedFile._(this.data, this.length, this.isMapped);
+
+  factory MappedFile.open(String path, {bool map = true}) {
+    final length = File(path).lengthSync();
+    if (map &&
+        !Platform.isWindows &&
+        length > 0 &&
+        length % _minPageSize != 0) {
+      final mapped = _map(path, length);
+      if (mapped != null) return MappedFile._(mapped, length, true);
+    }
+    return MappedFile.fromBytes(File(path).readAsBytesSync());
+  }
+
+  /// Copy [bytes] into a NUL terminated native buffer.
+  factory MappedFile.fromBytes(Uint8List bytes) {
+    return MappedFile._(nullTerminatedCopy(bytes), bytes.length, false);
+  }
+
+  static Pointer<Uint8>? _map(String path, int length) {
+    final utf8path = path.toNativeUtf8();
+    final fd = _open(utf8path, _O_RDONLY);
+    malloc.free(utf8path);
+    if (fd < 0) return null;
+    final ptr = _mmap(nullptr, length, _PROT_READ, _MAP_PRIVATE, fd, 0);
+    _close(fd);
+    // MAP_FAILED is (void *)-1
+    if (ptr.address == 0 || ptr.address == -1 || ptr.address == 0xFFFFFFFF)
+      return null;
+    return ptr;
+  }
+
+  void close() {
+    if (_closed) return;
+    _closed = true;
+    if (isMapped) {
+      _munmap(data, length);
+    } else {
+      malloc.free(data);
+    }
+  }
+}
@@ -49,16 +49,20 @@ class _DartFunction extends JSInvokable {
 class _DartObject extends JSRef implements JSRefLeakable {
   Object? _obj;
   Pointer<JSContext>? _ctx;
+
+  /// Id given to js as the opaque of the wrapping object.
+  int _id = 0;
+
   _DartObject(Pointer<JSContext> ctx, dynamic obj) {
     _ctx = ctx;
     _obj = obj;
     if (obj is JSRef) obj.dup();
-    runtimeOpaques[jsGetRuntime(ctx)]?.addRef(this);
+    _id = runtimeOpaques[jsGetRuntime(ctx)]?.addRef(this) ?? 0;
   }
 
   static _DartObject? fromAddress(Pointer<JSRuntime> rt, int val) {
-    return runtimeOpaques[rt]?.getRef((e) => identityHashCode(e) == val)
-        as _DartObject?;
+    if (val == 0) return null;
+    return runtimeOpaques[rt]?.getRef(val) as _DartObject?;
   }
 
   @override
@@ -74,7 +78,7 @@ class _DartObject extends JSRef implements JSRefLeakable {
     _ctx = null;
     _obj = null;
     if (ctx == null) return;
-    runtimeOpaques[jsGetRuntime(ctx)]?.removeRef(this);
+    runtimeOpaques[jsGetRuntime(ctx)]?.removeRef(_id);
     if (obj is JSRef) obj.free();
   }
 }
@@ -115,28 +119,35 @@ class JSError extends _IsolateEncodable {
 
 /// JS Object reference
 /// call [release] to release js object.
+///
+/// The value is also released once this wrapper is garbage collected, see
+/// [JSValueHandle].
 class _JSObject extends JSRef {
-  Pointer<JSValue>? _val;
-  Pointer<JSContext>? _ctx;
+  JSValueHandle? _handle;
+
+  /// Create. [type] is what the value is counted as in
+  /// [QuickJsRuntime2.liveHandleStats].
+  _JSObject(Pointer<JSContext> ctx, Pointer<JSValue> val,
+      [String type = 'JSObject']) {
+    _handle = jsTrackValue(ctx, jsDupValue(ctx, val), this, type);
+  }
 
-  /// Create
-  _JSObject(Pointer<JSContext> ctx, Pointer<JSValue> val) {
-    this._ctx = ctx;
-    final rt = jsGetRuntime(ctx);
-    this._val = jsDupValue(ctx, val);
-    runtimeOpaques[rt]?.addRef(this);
+  Pointer<JSValue>? get _val {
+    final handle = _handle;
+    return handle == null || handle.released ? null : handle.val;
+  }
+
+  Pointer<JSContext>? get _ctx {
+    final handle = _handle;
+    return handle == null || handle.released ? null : handle.ctx;
   }
 
   @override
   void destroy() {
-    final ctx = _ctx;
-    final val = _val;
-    _val = null;
-    _ctx = null;
-    if (ctx == null || val == null) return;
-    final rt = jsGetRuntime(ctx);
-    runtimeOpaques[rt]?.removeRef(this);
-    jsFreeValue(ctx, val);
+    final handle = _handle;
+    _handle = null;
+    if (handle == null) return;
+    jsReleaseValue(handle, this);
   }
 
   @override
@@ -148,7 +159,8 @@ class _JSObject extends JSRef {
 
 /// JS function wrapper
 class _JSFunction extends _JSObject implements JSInvokable, _IsolateEncodable {
-  _JSFunction(Pointer<JSContext> ctx, Pointer<JSValue> val) : super(ctx, val);
+  _JSFunction(Pointer<JSContext> ctx, Pointer<JSValue> val)
+      : super(ctx, val, 'JSFunction');
 
   @override
   invoke(List<dynamic> arguments, [dynamic thisVal]) {
@@ -189,6 +201,252 @@ class _JSFunction extends _JSObject implements JSInvokable, _IsolateEncodable {
   }
 }
 
+/// Persistent handle to a js function, see [QuickJsRuntime2.resolveFunction].
+class JSFunctionHandle {
+  final QuickJsRuntime2 _runtime;
+  _JSFunction? _fn;
+  JSFunctionHandle._(this._runtime, this._fn);
+
+  /// Whether the function is gone, by [release] or with its runtime.
+  bool get isReleased => _fn?._val == null;
+
+  _JSFunction get _function {
+    final fn = _fn;
+    if (fn == null) throw JSError("InternalError: JSFunctionHandle released");
+    return fn;
+  }
+
+  /// Call the function with [args] converted to js values.
+  dynamic call(List args, [dynamic thisVal]) {
+    return _function.invoke(args, thisVal);
+  }
+
+  /// Apply the function to every argument tuple in [argsList] in a single
+  /// native call. Arguments and results cross as json, with the same
+  /// rules both ways: NaN, infinities and typed data ([TypedData] on the
+  /// dart side, array buffers and typed arrays on the js side) are kept
+  /// when they are a whole argument or result, and inside lists and maps
+  /// follow `JSON.stringify`: non-finite numbers read as null and
+  /// `undefined` properties are dropped. A [Uint8List] arrives as an
+  /// `ArrayBuffer`, like with [call], other typed data as the matching
+  /// typed array; buffers and typed arrays come back as a [Uint8List].
+  ///
+  /// Unlike [call], results are never handles: a function or symbol result
+  /// throws a TypeError, and so does a bigint anywhere in a result.
+  List callBatch(Iterable<List> argsList) {
+    return _runtime._callBatch(_function, argsList);
+  }
+
+  void release() {
+    final fn = _fn;
+    _fn = null;
+    if (fn == null) return;
+    fn.free();
+  }
+}
+
+/// Applies `fn` to each tuple of the json batch `args` and returns the
+/// results as json, or as `[json, ...buffers]` when some of them are
+/// binary. Both json forms are `[special, values]`: `special` lists the
+/// whole values json cannot carry as `[tuple, argument, code]` going in and
+/// `[result, code]` coming out. Codes are 0 for NaN, 1 and -1 for the
+/// infinities and 2 for the next entry of `typed` or `buffers`.
+const _callBatchDriver = '''(fn, args, typed) => {
+  const [special, batch] = JSON.parse(args);
+  let next = 0;
+  for (const [i, j, code] of special) {
+    if (code === 2) {
+      const [kind, buffer] = typed[next++];
+      batch[i][j] = kind === 'ArrayBuffer' ? buffer : new globalThis[kind](buffer);
+    } else {
+      batch[i][j] = code === 0 ? NaN : code * Infinity;
+    }
+  }
+  const results = batch.map((a) => fn.apply(undefined, a));
+  const out = [];
+  const buffers = [];
+  for (let i = 0; i < results.length; i++) {
+    const value = results[i];
+    switch (typeof value) {
+      case 'undefined':
+        results[i] = null;
+        break;
+      case 'number':
+        if (isFinite(value)) break;
+        out.push([i, isNaN(value) ? 0 : Math.sign(value)]);
+        results[i] = null;
+        break;
+      case 'object':
+        if (value instanceof ArrayBuffer) {
+          buffers.push(value);
+        } else if (ArrayBuffer.isView(value)) {
+          buffers.push(value.buffer.slice(
+              value.byteOffset, value.byteOffset + value.byteLength));
+        } else {
+          break;
+        }
+        out.push([i, 2]);
+        results[i] = null;
+        break;
+      case 'function':
+      case 'symbol':
+        throw new TypeError('callBatch result ' + i + ' has no json form');
+    }
+  }
+  const json = '[' + JSON.stringify(out) + ',' + JSON.stringify(results) + ']';
+  return buffers.length ? [json, ...buffers] : json;
+}''';
+
+/// The js constructor [_callBatchDriver] rebuilds [data] with.
+String _typedArrayName(TypedData data) {
+  if (data is Uint8List) return 'ArrayBuffer';
+  if (data is Int8List) return 'Int8Array';
+  if (data is Uint8ClampedList) return 'Uint8ClampedArray';
+  if (data is Int16List) return 'Int16Array';
+  if (data is Uint16List) return 'Uint16Array';
+  if (data is Int32List) return 'Int32Array';
+  if (data is Uint32List) return 'Uint32Array';
+  if (data is Float32List) return 'Float32Array';
+  if (data is Float64List) return 'Float64Array';
+  if (data is Int64List) return 'BigInt64Array';
+  if (data is Uint64List) return 'BigUint64Array';
+  return 'DataView';
+}
+
+/// [value] with the non-finite numbers nested in it replaced by null, the
+/// way `JSON.stringify` treats them. Lists and maps are only copied when
+/// they contain one.
+dynamic _jsonSafe(dynamic value) {
+  if (value is double) return value.isFinite ? value : null;
+  if (value is List) {
+    List? copy;
+    for (var i = 0; i < value.length; ++i) {
+      final item = value[i];
+      final safe = _jsonSafe(item);
+      if (identical(safe, item)) continue;
+      copy ??= List.of(value);
+      copy[i] = safe;
+    }
+    return copy ?? value;
+  }
+  if (value is Map) {
+    Map? copy;
+    for (final entry in value.entries) {
+      final safe = _jsonSafe(entry.value);
+      if (identical(safe, entry.value)) continue;
+      copy ??= Map.of(value);
+      copy[entry.key] = safe;
+    }
+    return copy ?? value;
+  }
+  return value;
+}
+
+/// Handle backed view of a js object or array, see
+/// [QuickJsRuntime2.evaluate] with `lazy: true`.
+///
+/// Nothing is copied until it is read: `view['a']['b'][3]` fetches one
+/// property per step, [at] walks a whole path in the engine, and
+/// [materialize] converts the full graph like a regular evaluate would.
+/// Nested objects are returned as new views. Their js values are released
+/// when the view is garbage collected, or right away by [release].
+class JSObjectView {
+  final QuickJsRuntime2 _runtime;
+  _JSObject? _obj;
+  late final bool isArray;
+
+  JSObjectView._(
+    this._runtime,
+    Pointer<JSContext> ctx,
+    Pointer<JSValue> val,
+  ) : _obj = _JSObject(ctx, val) {
+    isArray = jsIsArray(ctx, val) != 0;
+  }
+
+  /// Whether the js value is gone, by [release] or with its runtime.
+  bool get isReleased => _obj?._val == null;
+
+  _JSObject get _object {
+    final obj = _obj;
+    if (obj == null || obj._val == null)
+      throw JSError("InternalError: JSObjectView released");
+    return obj;
+  }
+
+  /// Read a single property or array element.
+  dynamic operator [](dynamic key) {
+    final obj = _object;
+    final ctx = obj._ctx!;
+    final jsProp = _jsGetPropertyValue(ctx, obj._val!, key);
+    final ret = _runtime._jsToDartLazy(ctx, jsProp);
+    jsFreeValue(ctx, jsProp);
+    return ret;
+  }
+
+  /// Follow [path] without creating views for the intermediate objects.
+  /// Returns null when the path leaves the object graph.
+  dynamic at(Iterable path) {
+    final obj = _object;
+    final ctx = obj._ctx!;
+    var val = jsDupValue(ctx, obj._val!);
+    for (final key in path) {
+      if (jsValueGetTag(val) != JSTag.OBJECT) {
+        jsFreeValue(ctx, val);
+        return null;
+      }
+      final jsProp = _jsGetPropertyValue(ctx, val, key);
+      jsFreeValue(ctx, val);
+      val = jsProp;
+    }
+    final ret = _runtime._jsToDartLazy(ctx, val);
+    jsFreeValue(ctx, val);
+    return ret;
+  }
+
+  /// Array length, or the number of own enumerable keys of an object.
+  int get length {
+    final obj = _object;
+    final ctx = obj._ctx!;
+    if (!isArray) return _jsGetOwnPropertyKeys(ctx, obj._val!).length;
+    final jsLength = _jsGetPropertyValue(ctx, obj._val!, 'length');
+    final length = jsToInt64(ctx, jsLength);
+    jsFreeValue(ctx, jsLength);
+    return length;
+  }
+
+  /// Array indices, or the own enumerable keys of an object.
+  List get keys {
+    if (isArray) return List.generate(length, (i) => i);
+    final obj = _object;
+    return _jsGetOwnPropertyKeys(obj._ctx!, obj._val!);
+  }
+
+  /// Values in key order, fetched one by one while iterating.
+  Iterable get values sync* {
+    for (final key in keys) {
+      yield this[key];
+    }
+  }
+
+  /// Convert the whole object graph to dart Maps and Lists.
+  dynamic materialize() {
+    final obj = _object;
+    return _jsToDart(obj._ctx!, obj._val!);
+  }
+
+  void release() {
+    final obj = _obj;
+    _obj = null;
+    if (obj == null) return;
+    obj.free();
+  }
+
+  @override
+  String toString() {
+    return _obj?.toString() ?? "JSObjectView(released)";
+  }
+}
+
 /// Dart function wrapper for isolate
 class IsolateFunction extends JSInvokable implements _IsolateEncodable {
   int? _isolateId;
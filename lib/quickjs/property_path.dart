@@ -0,0 +1,217 @@
+part of './quickjs_runtime2.dart';
+
+/// A property path compiled once into engine atoms, see
+/// [QuickJsRuntime2.compilePath].
+///
+/// Applying it walks the path with one property lookup per step and only
+/// converts the leaf, so reading `data.items[3].price` from a large result
+/// does not materialize anything else. The column getters apply the path to
+/// every element of an array inside the engine, see [_columnDriver].
+///
+/// The atoms and the path array the columns use are released with this
+/// object, or right away by [release].
+class JSPropertyPath {
+  final QuickJsRuntime2 _runtime;
+
+  /// Keys of the path, strings and array indices.
+  final List path;
+
+  /// Context and engine generation the atoms were made in. A context
+  /// pointer alone may be reused by the next engine after a close.
+  Pointer<JSContext>? _ctx;
+  int _generation = 0;
+  JSAtomsHandle? _atoms;
+
+  /// [path] as a js array, for [_columnDriver].
+  _JSObject? _jsPath;
+
+  JSPropertyPath._(this._runtime, this.path);
+
+  static final _segment = RegExp(r'([^.\[\]]+)|\[(\d+)\]');
+
+  /// Split `a.b[3].c` into `['a', 'b', 3, 'c']`.
+  static List parse(String path) {
+    return _segment.allMatches(path).map((match) {
+      final index = match.group(2);
+      return index != null ? int.parse(index) : match.group(1)!;
+    }).toList();
+  }
+
+  bool _isCompiledFor(Pointer<JSContext> ctx) =>
+      _ctx == ctx && _generation == _runtime._engineGeneration;
+
+  List<int> _compile(Pointer<JSContext> ctx) {
+    final atoms = _atoms;
+    if (atoms != null && _isCompiledFor(ctx)) return atoms.atoms;
+    if (!_isCompiledFor(ctx)) release();
+    _ctx = ctx;
+    _generation = _runtime._engineGeneration;
+    final compiled = path.map((key) {
+      final jsKey = _dartToJs(ctx, key);
+      final jsAtom = jsValueToAtom(ctx, jsKey);
+      jsFreeValue(ctx, jsKey);
+      return jsAtom;
+    }).toList();
+    _atoms = jsTrackAtoms(ctx, compiled, this);
+    return compiled;
+  }
+
+  Pointer<JSValue> _pathValue(Pointer<JSContext> ctx) {
+    final jsPath = _jsPath;
+    if (jsPath != null && _isCompiledFor(ctx)) return jsPath._val!;
+    if (!_isCompiledFor(ctx)) release();
+    _ctx = ctx;
+    _generation = _runtime._engineGeneration;
+    final val = _dartToJs(ctx, path);
+    final obj = _jsPath = _JSObject(ctx, val, 'JSPropertyPath');
+    jsFreeValue(ctx, val);
+    return obj._val!;
+  }
+
+  /// Follow the path from [root]. Returns null when it leaves the object
+  /// graph, otherwise a new value the caller must free.
+  Pointer<JSValue>? _resolve(Pointer<JSContext> ctx, Pointer<JSValue> root) {
+    var val = jsDupValue(ctx, root);
+    for (final atom in _compile(ctx)) {
+      if (jsValueGetTag(val) != JSTag.OBJECT) {
+        jsFreeValue(ctx, val);
+        return null;
+      }
+      final jsProp = jsGetProperty(ctx, val, atom);
+      jsFreeValue(ctx, val);
+      val = jsProp;
+    }
+    return val;
+  }
+
+  /// Apply the path to [target] and convert the leaf with [extract].
+  T? _apply<T>(
+    dynamic target,
+    T? Function(Pointer<JSContext> ctx, Pointer<JSValue> val) extract,
+  ) {
+    return _runtime._withJsValue(target, (ctx, root) {
+      final val = _resolve(ctx, root);
+      if (val == null) return null;
+      try {
+        return extract(ctx, val);
+      } finally {
+        jsFreeValue(ctx, val);
+      }
+    });
+  }
+
+  /// Apply the path to each element of the array [target] with one engine
+  /// call, which returns the leaves as [kind] asks, see [_columnDriver].
+  dynamic _column(dynamic target, String kind) {
+    return _runtime._withJsValue(target, (ctx, array) {
+      final jsKind = _dartToJs(ctx, kind);
+      final jsRet = _runtime
+          ._builtinCall(_columnDriver, [array, _pathValue(ctx), jsKind]);
+      jsFreeValue(ctx, jsKind);
+      if (jsIsException(jsRet) != 0) {
+        jsFreeValue(ctx, jsRet);
+        throw _parseJSException(ctx);
+      }
+      try {
+        switch (kind) {
+          case 'number':
+            final Uint8List bytes = _jsToDart(ctx, jsRet);
+            return bytes.buffer.asFloat64List(0, bytes.length ~/ 8);
+          case 'string':
+            return jsonDecode(jsToCString(ctx, jsRet));
+        }
+        final jsLength = _jsGetPropertyValue(ctx, jsRet, 'length');
+        final length = jsToInt64(ctx, jsLength);
+        jsFreeValue(ctx, jsLength);
+        return List.generate(length, (i) {
+          final item = _jsGetPropertyValue(ctx, jsRet, i);
+          try {
+            return _runtime._jsToDartLazy(ctx, item);
+          } finally {
+            jsFreeValue(ctx, item);
+          }
+        });
+      } finally {
+        jsFreeValue(ctx, jsRet);
+      }
+    });
+  }
+
+  /// The leaf converted like an evaluate result.
+  dynamic get(dynamic target) => _apply(target, _runtime._jsToDartLazy);
+
+  int? getInt(dynamic target) => _apply(target, _toInt);
+
+  double? getDouble(dynamic target) => _apply(target, _toDouble);
+
+  String? getString(dynamic target) => _apply(target, _toString);
+
+  List columnOf(dynamic target) => _column(target, 'any');
+
+  /// Leaves that are not finite numbers are null.
+  List<int?> columnInt(dynamic target) {
+    final Float64List column = _column(target, 'number');
+    return [for (final v in column) v.isFinite ? v.toInt() : null];
+  }
+
+  /// Leaves that are not numbers are NaN.
+  Float64List columnDouble(dynamic target) => _column(target, 'number');
+
+  List<String?> columnString(dynamic target) =>
+      List<String?>.from(_column(target, 'string'));
+
+  static int? _toInt(Pointer<JSContext> ctx, Pointer<JSValue> val) {
+    final tag = jsValueGetTag(val);
+    if (tag != JSTag.INT && jsTagIsFloat64(tag) == 0) return null;
+    return jsToInt64(ctx, val);
+  }
+
+  static double? _toDouble(Pointer<JSContext> ctx, Pointer<JSValue> val) {
+    final tag = jsValueGetTag(val);
+    if (tag != JSTag.INT && jsTagIsFloat64(tag) == 0) return null;
+    return jsToFloat64(ctx, val);
+  }
+
+  static String? _toString(Pointer<JSContext> ctx, Pointer<JSValue> val) {
+    if (jsValueGetTag(val) != JSTag.STRING) return null;
+    return jsToCString(ctx, val);
+  }
+
+  /// Free the compiled atoms and path array. The path compiles again on
+  /// next use.
+  void release() {
+    final atoms = _atoms;
+    final jsPath = _jsPath;
+    _ctx = null;
+    _atoms = null;
+    _jsPath = null;
+    // atoms and values of a closed engine were freed with it
+    if (atoms != null) jsReleaseAtoms(atoms, this);
+    jsPath?.free();
+  }
+}
+
+/// Applies `path` to each element of `array` and returns the leaves: as a
+/// Float64Array buffer with NaN for non-numbers when `kind` is 'number', as
+/// json with null for non-strings when it is 'string', and as an array
+/// otherwise. A path that leaves the object graph yields undefined.
+const _columnDriver = '''(array, path, kind) => {
+  const leaf = (item) => {
+    let val = item;
+    for (const key of path) {
+      if (val === null || (typeof val !== 'object' && typeof val !== 'function'))
+        return undefined;
+      val = val[key];
+    }
+    return val;
+  };
+  const leaves = Array.prototype.map.call(array, leaf);
+  switch (kind) {
+    case 'number':
+      return new Float64Array(
+          leaves.map((v) => typeof v === 'number' ? v : NaN)).buffer;
+    case 'string':
+      return JSON.stringify(leaves.map((v) => typeof v === 'string' ? v : null));
+  }
+  return leaves;
+}''';
@@ -258,6 +258,7 @@ class QuickJsRuntime extends JavascriptRuntime {
 
   @override
   void dispose() {
+    runDisposeHooks();
     // Todo: free runtime and context
   }
 
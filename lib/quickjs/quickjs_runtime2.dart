@@ -7,14 +7,30 @@ import 'dart:isolate';
 import 'dart:typed_data';
 
 import 'package:ffi/ffi.dart';
+import 'package:flutter/services.dart' show rootBundle;
 import 'package:flutter_js/flutter_js.dart';
 
 import 'ffi.dart';
-
-export 'ffi.dart' show JSEvalFlag, JSRef;
-
+import 'mapped_file.dart';
+import 'trace.dart';
+
+export 'ffi.dart'
+    show
+        JSEvalFlag,
+        JSRef,
+        JSRuntimeUsage,
+        JSSharedMemory,
+        jsCanEvalBytecode,
+        jsCanInterrupt,
+        jsCanShareMemory;
+export 'trace.dart';
+
+part './clone.dart';
+part './command_buffer.dart';
 part './isolate.dart';
+part './json.dart';
 part './object.dart';
+part './property_path.dart';
 part './wrapper.dart';
 
 /// Handler function to manage js module.
@@ -37,6 +53,24 @@ class QuickJsRuntime2 extends JavascriptRuntime {
   /// Max memory for quickjs.
   final int? memoryLimit;
 
+  /// Max time this runtime may spend inside the engine. A script running
+  /// past it is interrupted, and later evaluations and calls throw an
+  /// InternalError until [resetUsage] is called. Implies [trackUsage].
+  ///
+  /// Interrupting takes over the engine's interrupt handler, which then
+  /// enforces [timeout] per call from dart in its place.
+  final Duration? cpuQuota;
+
+  /// Count evaluations, calls, jobs, source bytes and engine time in
+  /// [usage]. Off by default, since it times every crossing.
+  final bool trackUsage;
+
+  /// Compile the polyfills of the extensions, such as XMLHttpRequest,
+  /// fetch and Worker, only when script first reads one of their globals.
+  /// Off by default.
+  @override
+  final bool lazyPolyfills;
+
   /// Message Port for event loop. Close it to stop dispatching event loop.
   ReceivePort port = ReceivePort();
 
@@ -46,13 +80,33 @@ class QuickJsRuntime2 extends JavascriptRuntime {
   /// Handler function to manage js module.
   final _JsHostPromiseRejectionHandler? hostPromiseRejectionHandler;
 
+  /// Builtin helpers resolved once per context, keyed by their source.
+  final Map<String, _JSFunction> _builtinFunctions = {};
+
+  /// Bumped whenever [_ensureEngine] creates an engine, so state tied to
+  /// one engine can tell it from the next.
+  int _engineGeneration = 0;
+
+  /// Whether `Atomics.wait` may block once [enableSharedMemory] was called,
+  /// so engines created later share memory too.
+  bool? _sharedMemoryCanBlock;
+
+  /// Whether the current engine allocates shareable SharedArrayBuffers.
+  bool _sharesMemory = false;
+
+  /// Live handle statistics found when the engine was last closed.
+  Map<String, int> lastTeardownStats = {};
+
   QuickJsRuntime2({
     this.moduleHandler,
     this.stackSize = 1024 * 1024,
     this.timeout,
     this.memoryLimit,
     this.hostPromiseRejectionHandler,
-  }) {
+    this.cpuQuota,
+    bool trackUsage = false,
+    this.lazyPolyfills = false,
+  }) : trackUsage = trackUsage || cpuQuota != null {
     this.init();
   }
 
@@ -62,27 +116,15 @@ class QuickJsRuntime2 extends JavascriptRuntime {
       try {
         switch (type) {
           case JSChannelType.METHON:
-            final pdata = ptr.cast<Pointer<JSValue>>();
-            final argc = pdata[1].cast<Int32>().value;
-            final pargs = [];
-            for (var i = 0; i < argc; ++i) {
-              pargs.add(_jsToDart(
-                ctx,
-                Pointer.fromAddress(
-                  pdata[2].address + sizeOfJSValue * i,
-                ),
-              ));
+            final trace = kQuickJsTrace
+                ? QuickJsTrace.begin(QuickJsTraceEvent.hostCallback)
+                : 0;
+            try {
+              return _invokeHostFunction(ctx, ptr);
+            } finally {
+              if (kQuickJsTrace)
+                QuickJsTrace.end(QuickJsTraceEvent.hostCallback, trace);
             }
-            final JSInvokable func = _jsToDart(
-              ctx,
-              pdata[3],
-            );
-            return _dartToJs(
-                ctx,
-                func.invoke(
-                  pargs,
-                  _jsToDart(ctx, pdata[0]),
-                ));
           case JSChannelType.MODULE:
             if (moduleHandler == null) throw JSError('No ModuleHandler');
             final ret = moduleHandler!(
@@ -130,39 +172,132 @@ class QuickJsRuntime2 extends JavascriptRuntime {
     final memoryLimit = this.memoryLimit ?? 0;
     if (memoryLimit > 0) jsSetMemoryLimit(rt, memoryLimit);
     _rt = rt;
+    _engineGeneration++;
+    if (trackUsage) {
+      final timeout = this.timeout ?? 0;
+      jsEnableUsage(
+        rt,
+        cpuQuotaMicros: cpuQuota?.inMicroseconds,
+        timeoutMicros: timeout > 0 ? timeout * 1000 : null,
+      );
+    }
+    final canBlock = _sharedMemoryCanBlock;
+    _sharesMemory =
+        canBlock != null && jsEnableSharedMemory(rt, canBlock: canBlock);
     _ctx = jsNewContext(rt);
   }
 
+  /// Call the dart function behind a js call through the channel.
+  Pointer<JSValue> _invokeHostFunction(
+    Pointer<JSContext> ctx,
+    Pointer<JSValue> ptr,
+  ) {
+    final pdata = ptr.cast<Pointer<JSValue>>();
+    final argc = pdata[1].cast<Int32>().value;
+    final JSInvokable func = _jsToDart(
+      ctx,
+      pdata[3],
+    );
+    // a clone receiver takes its last argument as a structured clone
+    final converted = func is _CloneFunction && argc > 0 ? argc - 1 : argc;
+    final pargs = [];
+    for (var i = 0; i < converted; ++i) {
+      pargs.add(_jsToDart(
+        ctx,
+        Pointer.fromAddress(
+          pdata[2].address + sizeOfJSValue * i,
+        ),
+      ));
+    }
+    if (func is _CloneFunction) {
+      final data = argc > converted
+          ? _cloneOut(
+              ctx,
+              Pointer.fromAddress(
+                pdata[2].address + sizeOfJSValue * converted,
+              ))
+          : JSCloneData._('{"t":"u"}');
+      func._fn(pargs, data);
+      return _dartToJs(ctx, null);
+    }
+    return _dartToJs(
+        ctx,
+        func.invoke(
+          pargs,
+          _jsToDart(ctx, pdata[0]),
+        ));
+  }
+
   /// Free Runtime and Context which can be recreate when evaluate again.
   close() {
     final rt = _rt;
     final ctx = _ctx;
+    if (rt == null || ctx == null) return;
+    // values held from dart go while the context can still run jobs
+    _executePendingJob();
+    for (final fn in _builtinFunctions.values) {
+      fn.free();
+    }
+    _builtinFunctions.clear();
+    for (final obj in localContext.values) {
+      JSRef.freeRecursive(obj);
+    }
+    localContext.clear();
     _rt = null;
     _ctx = null;
-    if (ctx != null) jsFreeContext(ctx);
-    if (rt == null) return;
-    _executePendingJob();
-    try {
-      for (final obj in localContext.values) {
-        JSRef.freeRecursive(obj);
-      }
-      jsFreeRuntime(rt);
-    } on String catch (e) {
-      throw JSError(e);
+    jsFreeContext(ctx);
+    lastTeardownStats = jsFreeRuntime(rt);
+    if (JavascriptRuntime.debugEnabled && lastTeardownStats.isNotEmpty) {
+      print('QuickJsRuntime2 released live handles: $lastTeardownStats');
     }
   }
 
+  /// Dart objects referenced from js and js values referenced from dart,
+  /// counted by type.
+  Map<String, int> get liveHandleStats {
+    final rt = _rt;
+    return rt == null ? {} : jsLiveHandleStats(rt);
+  }
+
   void _executePendingJob() {
     final rt = _rt;
     final ctx = _ctx;
     if (rt == null || ctx == null) return;
-    while (true) {
-      int err = jsExecutePendingJob(rt);
+    jsReleasePendingValues(rt);
+    final usage = jsRuntimeUsage(rt);
+    final trace =
+        kQuickJsTrace ? QuickJsTrace.begin(QuickJsTraceEvent.pendingJobs) : 0;
+    while (usage == null || !usage.quotaExceeded) {
+      int err = usage == null
+          ? jsExecutePendingJob(rt)
+          : jsAccountUsage(rt, () => jsExecutePendingJob(rt));
       if (err <= 0) {
         if (err < 0) print(_parseJSException(ctx));
         break;
       }
+      usage?.jobCount += 1;
     }
+    if (kQuickJsTrace) QuickJsTrace.end(QuickJsTraceEvent.pendingJobs, trace);
+  }
+
+  /// Resources used by this runtime since it was created or since the last
+  /// [resetUsage], or null unless [trackUsage] is set.
+  ///
+  /// The runtime has a single context and a heap of its own, so a tenant
+  /// is isolated by giving it a runtime.
+  JSRuntimeUsage? get usage {
+    _ensureEngine();
+    return jsRuntimeUsage(_rt!);
+  }
+
+  /// Clear the usage counters, which also lifts an exceeded [cpuQuota].
+  void resetUsage() => usage?.reset();
+
+  /// Live allocations and bytes of this runtime's heap by kind, see
+  /// [jsMemoryUsage]. Walks the heap, so it is meant for diagnostics.
+  Map<String, int> get memoryUsage {
+    _ensureEngine();
+    return jsMemoryUsage(_rt!);
   }
 
   /// Dispatch JavaScript Event loop.
@@ -178,11 +313,15 @@ class QuickJsRuntime2 extends JavascriptRuntime {
   }
 
   /// Evaluate js script.
+  ///
+  /// With [lazy], objects and arrays in the result are returned as a
+  /// [JSObjectView] instead of being converted to dart Maps and Lists.
   JsEvalResult evaluate(
     String command, {
     String? name,
     int? evalFlags,
     String? sourceUrl,
+    bool lazy = false,
   }) {
     _ensureEngine();
     final ctx = _ctx!;
@@ -192,20 +331,389 @@ class QuickJsRuntime2 extends JavascriptRuntime {
       name ?? '<eval>',
       evalFlags ?? JSEvalFlag.GLOBAL,
     );
+    return _evalResult(ctx, jsval, lazy);
+  }
+
+  /// Evaluate the script in the file at [path].
+  ///
+  /// The file is memory mapped and compiled in place where the platform
+  /// allows it, and unmapped right after, so a large bundle never exists as
+  /// a dart string or as extra heap copies. Truncating the file while it is
+  /// compiled crashes the process with SIGBUS; pass `map: false` to read it
+  /// into a buffer instead when that can happen, see [MappedFile].
+  JsEvalResult evaluateFile(
+    String path, {
+    String? name,
+    int? evalFlags,
+    bool lazy = false,
+    bool map = true,
+  }) {
+    return _evaluateSource(
+      MappedFile.open(path, map: map),
+      name ?? path,
+      evalFlags,
+      lazy,
+    );
+  }
 
+  /// Evaluate a script from the asset bundle without decoding it into a
+  /// dart string first.
+  Future<JsEvalResult> evaluateAsset(
+    String key, {
+    String? name,
+    int? evalFlags,
+    bool lazy = false,
+  }) async {
+    final data = await rootBundle.load(key);
+    return evaluateBytes(
+      data.buffer.asUint8List(data.offsetInBytes, data.lengthInBytes),
+      name: name ?? key,
+      evalFlags: evalFlags,
+      lazy: lazy,
+    );
+  }
+
+  /// Evaluate utf8 encoded [source], e.g. an asset loaded ahead of time,
+  /// without decoding it into a dart string first. The bytes are copied
+  /// into a native buffer, so [source] may itself be a view of a mapping.
+  JsEvalResult evaluateBytes(
+    Uint8List source, {
+    String? name,
+    int? evalFlags,
+    bool lazy = false,
+  }) {
+    return _evaluateSource(
+        MappedFile.fromBytes(source), name ?? '<eval>', evalFlags, lazy);
+  }
+
+  /// Compile the script [source] to bytecode for [evaluateBytecode], so it
+  /// can be cached and loaded later without parsing. Bytecode is specific
+  /// to the library that wrote it. Throws an [UnsupportedError] unless
+  /// [jsCanEvalBytecode] holds.
+  Uint8List compileBytecode(String source, {String? name}) {
+    if (!jsCanEvalBytecode)
+      throw UnsupportedError('The QuickJS library cannot write bytecode');
+    _ensureEngine();
+    final ctx = _ctx!;
+    final bytes = utf8.encode(source);
+    final ptr = nullTerminatedCopy(bytes);
+    final fn = jsEvalUtf8(ctx, ptr, bytes.length, name ?? '<eval>',
+        JSEvalFlag.GLOBAL | JSEvalFlag.COMPILE_ONLY);
+    malloc.free(ptr);
+    if (jsIsException(fn) != 0) {
+      jsFreeValue(ctx, fn);
+      throw _parseJSException(ctx);
+    }
+    final bytecode = jsWriteBytecode(ctx, fn);
+    jsFreeValue(ctx, fn);
+    if (bytecode == null) throw _parseJSException(ctx);
+    return bytecode;
+  }
+
+  /// Evaluate a script compiled by [compileBytecode] with the same library.
+  /// Never pass bytecode from an untrusted source: the engine does not
+  /// verify it. Throws an [UnsupportedError] unless [jsCanEvalBytecode]
+  /// holds.
+  JsEvalResult evaluateBytecode(Uint8List bytecode, {bool lazy = false}) {
+    if (!jsCanEvalBytecode)
+      throw UnsupportedError('The QuickJS library cannot read bytecode');
+    _ensureEngine();
+    final ctx = _ctx!;
+    final ptr = nullTerminatedCopy(bytecode);
+    final jsval = jsEvalBytecode(ctx, ptr, bytecode.length);
+    malloc.free(ptr);
+    return _evalResult(ctx, jsval, lazy);
+  }
+
+  JsEvalResult _evaluateSource(
+    MappedFile source,
+    String name,
+    int? evalFlags,
+    bool lazy,
+  ) {
+    final Pointer<JSValue> jsval;
+    try {
+      _ensureEngine();
+      jsval = jsEvalUtf8(
+        _ctx!,
+        source.data,
+        source.length,
+        name,
+        evalFlags ?? JSEvalFlag.GLOBAL,
+      );
+    } finally {
+      source.close();
+    }
+    return _evalResult(_ctx!, jsval, lazy);
+  }
+
+  JsEvalResult _evalResult(
+    Pointer<JSContext> ctx,
+    Pointer<JSValue> jsval,
+    bool lazy,
+  ) {
     if (jsIsException(jsval) != 0) {
       jsFreeValue(ctx, jsval);
       JSError exception = _parseJSException(ctx);
       return JsEvalResult(exception.toString(), exception, isError: true);
     }
-    final result = _jsToDart(ctx, jsval);
+    final result = lazy ? _jsToDartLazy(ctx, jsval) : _jsToDart(ctx, jsval);
     jsFreeValue(ctx, jsval);
     return JsEvalResult(result?.toString() ?? "null", result);
   }
 
+  /// Run every command of [buffer] and return one result per command.
+  ///
+  /// Consecutive commands go to the engine in a single call; only
+  /// [JSCommandBuffer.drainJobs] and [JSCommandBuffer.eval] split the
+  /// buffer. Execution stops at the first failing command, whose result has
+  /// `isError` set, so the returned list may be shorter than the buffer.
+  List<JsEvalResult> execute(JSCommandBuffer buffer) {
+    _ensureEngine();
+    final ctx = _ctx!;
+    final results = <JsEvalResult>[];
+    var segment = <List>[];
+    var failed = false;
+    void flush() {
+      if (segment.isEmpty || failed) return;
+      final jsCommands = _dartToJs(ctx, segment);
+      final jsRet = _builtinCall(_commandBufferDriver, [jsCommands]);
+      jsFreeValue(ctx, jsCommands);
+      segment = [];
+      if (jsIsException(jsRet) != 0) {
+        jsFreeValue(ctx, jsRet);
+        final exception = _parseJSException(ctx);
+        results.add(
+            JsEvalResult(exception.toString(), exception, isError: true));
+        failed = true;
+        return;
+      }
+      final List ret = _jsToDart(ctx, jsRet);
+      jsFreeValue(ctx, jsRet);
+      for (final entry in ret) {
+        final value = entry[1];
+        if (entry[0] == true) {
+          results.add(JsEvalResult(value?.toString() ?? "null", value));
+        } else {
+          results.add(JsEvalResult(value.toString(), value, isError: true));
+          failed = true;
+        }
+      }
+    }
+
+    for (final command in buffer._commands) {
+      final op = command[0];
+      if (op != JSCommandBuffer._DRAIN_JOBS && op != JSCommandBuffer._EVAL) {
+        segment.add(command);
+        continue;
+      }
+      flush();
+      if (failed) break;
+      if (op == JSCommandBuffer._EVAL) {
+        final result = evaluate(command[1]);
+        results.add(result);
+        if (result.isError) {
+          failed = true;
+          break;
+        }
+      } else {
+        _executePendingJob();
+        results.add(JsEvalResult("null", null));
+      }
+    }
+    flush();
+    return results;
+  }
+
+  /// Allocate SharedArrayBuffers so that clones, see [JSCloneData], share
+  /// their memory with runtimes on other isolates instead of copying it.
+  /// [canBlock] lets `Atomics.wait` block the thread, which is meant for
+  /// worker runtimes rather than the ui isolate.
+  ///
+  /// Returns false where the library lacks the api, see [jsCanShareMemory];
+  /// SharedArrayBuffers are then cloned as plain ArrayBuffers. Call it
+  /// before any SharedArrayBuffer is created.
+  bool enableSharedMemory({bool canBlock = false}) {
+    _sharedMemoryCanBlock = canBlock;
+    final rt = _rt;
+    if (rt != null) {
+      _sharesMemory = jsEnableSharedMemory(rt, canBlock: canBlock);
+    }
+    return jsCanShareMemory;
+  }
+
+  /// Install a global js function [name] that passes a structured clone of
+  /// its last argument to [fn], after the other arguments converted as
+  /// usual. Clones are meant for another runtime, see [callWithClone].
+  void defineCloneReceiver(
+    String name,
+    void Function(List args, JSCloneData data) fn,
+  ) {
+    _defineGlobal(name, _CloneFunction(fn));
+  }
+
+  /// Call [fn] with [args] converted as usual, followed by the value
+  /// [data] was cloned from, rebuilt in this runtime.
+  dynamic callWithClone(JSFunctionHandle fn, List args, JSCloneData data) {
+    final func = fn._function;
+    final ctx = func._ctx;
+    final val = func._val;
+    if (ctx == null || val == null)
+      throw JSError("InternalError: JSValue released");
+    final jsData = _cloneIn(ctx, data);
+    if (jsIsException(jsData) != 0) {
+      jsFreeValue(ctx, jsData);
+      throw _parseJSException(ctx);
+    }
+    final jsArgs = [for (final arg in args) _dartToJs(ctx, arg), jsData];
+    final jsThis = jsUNDEFINED();
+    final jsRet = jsCall(ctx, val, jsThis, jsArgs);
+    jsFreeValue(ctx, jsThis);
+    for (final jsArg in jsArgs) {
+      jsFreeValue(ctx, jsArg);
+    }
+    if (jsIsException(jsRet) != 0) {
+      jsFreeValue(ctx, jsRet);
+      throw _parseJSException(ctx);
+    }
+    final ret = _jsToDart(ctx, jsRet);
+    jsFreeValue(ctx, jsRet);
+    return ret;
+  }
+
+  /// Clone [val] with [_cloneEncoder].
+  JSCloneData _cloneOut(Pointer<JSContext> ctx, Pointer<JSValue> val) {
+    final jsRet = _builtinCall(_cloneEncoder, [val]);
+    if (jsIsException(jsRet) != 0) {
+      jsFreeValue(ctx, jsRet);
+      throw _parseJSException(ctx);
+    }
+    try {
+      if (jsIsArray(ctx, jsRet) == 0) {
+        return JSCloneData._(jsToCString(ctx, jsRet));
+      }
+      final jsJson = _jsGetPropertyValue(ctx, jsRet, 0);
+      final jsKinds = _jsGetPropertyValue(ctx, jsRet, 1);
+      final json = jsToCString(ctx, jsJson);
+      final kinds = jsToCString(ctx, jsKinds);
+      jsFreeValue(ctx, jsJson);
+      jsFreeValue(ctx, jsKinds);
+      final buffers = <Object>[];
+      final psize = malloc<IntPtr>();
+      for (var i = 0; i < kinds.length; ++i) {
+        final jsBuffer = _jsGetPropertyValue(ctx, jsRet, i + 2);
+        final buf = jsGetArrayBuffer(ctx, psize, jsBuffer);
+        final size = psize.value;
+        jsFreeValue(ctx, jsBuffer);
+        final shared = kinds[i] == 'h' ? jsShareMemory(buf, size) : null;
+        if (shared != null) {
+          buffers.add(shared);
+        } else {
+          buffers.add(size == 0
+              ? Uint8List(0)
+              : Uint8List.fromList(buf.asTypedList(size)));
+        }
+      }
+      malloc.free(psize);
+      return JSCloneData._(json, buffers);
+    } finally {
+      jsFreeValue(ctx, jsRet);
+    }
+  }
+
+  /// Rebuild the value of [data] with [_cloneDecoder].
+  Pointer<JSValue> _cloneIn(Pointer<JSContext> ctx, JSCloneData data) {
+    final args = [jsNewString(ctx, data.json)];
+    for (final buffer in data.buffers) {
+      if (buffer is! JSSharedMemory) {
+        args.add(_dartToJs(ctx, buffer));
+      } else if (_sharesMemory) {
+        args.add(jsAdoptSharedMemory(ctx, buffer));
+      } else {
+        final bytes = Pointer<Uint8>.fromAddress(buffer.address)
+            .asTypedList(buffer.length);
+        args.add(_dartToJs(ctx, Uint8List.fromList(bytes)));
+        jsDropSharedMemory(buffer);
+      }
+    }
+    final jsRet = _builtinCall(_cloneDecoder, args);
+    for (final arg in args) {
+      jsFreeValue(ctx, arg);
+    }
+    return jsRet;
+  }
+
+  /// Compile [path] (`'a.b[3]'` or `['a', 'b', 3]`) for repeated reads of
+  /// single values with [JSPropertyPath].
+  JSPropertyPath compilePath(dynamic path) {
+    return JSPropertyPath._(
+      this,
+      List.unmodifiable(path is String ? JSPropertyPath.parse(path) : path),
+    );
+  }
+
+  /// Run [fn] on the js value behind [target]: a [JSObjectView], a js
+  /// object reference, or a dart value converted for the call.
+  T _withJsValue<T>(
+    dynamic target,
+    T Function(Pointer<JSContext> ctx, Pointer<JSValue> val) fn,
+  ) {
+    final obj = target is JSObjectView ? target._object : target;
+    if (obj is _JSObject) {
+      final ctx = obj._ctx;
+      final val = obj._val;
+      if (ctx == null || val == null)
+        throw JSError("InternalError: JSValue released");
+      return fn(ctx, val);
+    }
+    _ensureEngine();
+    final ctx = _ctx!;
+    final val = _dartToJs(ctx, obj);
+    try {
+      return fn(ctx, val);
+    } finally {
+      jsFreeValue(ctx, val);
+    }
+  }
+
+  /// Like [_jsToDart], but plain objects and arrays become a [JSObjectView].
+  dynamic _jsToDartLazy(Pointer<JSContext> ctx, Pointer<JSValue> val) {
+    if (!_isPlainObject(ctx, val)) return _jsToDart(ctx, val);
+    return JSObjectView._(this, ctx, val);
+  }
+
+  /// Call [fn] (a [JSInvokable] or [JSFunctionHandle]) with [obj] as its
+  /// only argument.
   @override
-  JsEvalResult callFunction(Pointer<NativeType> fn, Pointer<NativeType> obj) {
-    throw UnimplementedError();
+  JsEvalResult callFunction(dynamic fn, dynamic obj) {
+    try {
+      final JSInvokable func = fn is JSFunctionHandle ? fn._function : fn;
+      final result = func.invoke([obj]);
+      return JsEvalResult(result?.toString() ?? "null", result);
+    } catch (e) {
+      return JsEvalResult(e.toString(), e, isError: true);
+    }
+  }
+
+  /// Evaluate [source] once and keep the resulting function alive, so it can
+  /// be called repeatedly without generating js source.
+  /// The function is released with the handle, or by
+  /// [JSFunctionHandle.release].
+  JSFunctionHandle resolveFunction(String source) {
+    _ensureEngine();
+    final ctx = _ctx!;
+    final jsval = jsEval(ctx, source, '<function>', JSEvalFlag.GLOBAL);
+    if (jsIsException(jsval) != 0) {
+      jsFreeValue(ctx, jsval);
+      throw _parseJSException(ctx);
+    }
+    if (jsIsFunction(ctx, jsval) == 0) {
+      jsFreeValue(ctx, jsval);
+      throw JSError('TypeError: $source is not a function');
+    }
+    final handle = JSFunctionHandle._(this, _JSFunction(ctx, jsval));
+    jsFreeValue(ctx, jsval);
+    return handle;
   }
 
   @override
@@ -215,12 +723,9 @@ class QuickJsRuntime2 extends JavascriptRuntime {
 
   @override
   void dispose() {
-    try {
-      port.close(); // stop dispatch loop
-      close(); // close engine
-    } on JSError catch (e) {
-      print(e); // catch reference leak exception
-    }
+    runDisposeHooks();
+    port.close(); // stop dispatch loop
+    close(); // close engine
   }
 
   @override
@@ -242,10 +747,7 @@ class QuickJsRuntime2 extends JavascriptRuntime {
   @override
   void initChannelFunctions() {
     JavascriptRuntime.channelFunctionsRegistered[getEngineInstanceId()] = {};
-    final setToGlobalObject =
-        evaluate("(key, val) => { this[key] = val; }").rawResult;
-    localContext['setToGlobalObject'] = setToGlobalObject;
-    (setToGlobalObject as JSInvokable).invoke([
+    _defineGlobal(
       'sendMessage',
       (String channelName, String message) {
         final channelFunctions = JavascriptRuntime
@@ -259,13 +761,234 @@ class QuickJsRuntime2 extends JavascriptRuntime {
         if (JavascriptRuntime.debugEnabled) {
           print('CHANNEL: $channelName - Message: $message');
         }
-      }
-    ]);
+      },
+    );
   }
 
+  /// Set `globalThis[name]` to [value] converted to js. Unlike
+  /// [JSCommandBuffer.defineGlobal] this does not need the command buffer
+  /// driver, which is only compiled once [execute] is used.
+  void _defineGlobal(String name, dynamic value) {
+    _ensureEngine();
+    final ctx = _ctx!;
+    final jsName = _dartToJs(ctx, name);
+    final jsValue = _dartToJs(ctx, value);
+    final jsRet = _builtinCall(
+      '(name, value) => { globalThis[name] = value; }',
+      [jsName, jsValue],
+    );
+    jsFreeValue(ctx, jsName);
+    jsFreeValue(ctx, jsValue);
+    if (jsIsException(jsRet) != 0) {
+      jsFreeValue(ctx, jsRet);
+      throw _parseJSException(ctx);
+    }
+    jsFreeValue(ctx, jsRet);
+  }
+
+  /// Values without a json representation, such as `undefined`, read as
+  /// "null".
   @override
   String jsonStringify(JsEvalResult jsValue) {
-    throw UnimplementedError();
+    final bytes = jsonStringifyBytes(jsValue.rawResult);
+    return bytes == null ? 'null' : utf8.decode(bytes, allowMalformed: true);
+  }
+
+  /// Call the function compiled from [source] with [args] and serialize its
+  /// result with the engine's `JSON.stringify`, so the result is never
+  /// converted to dart. [source] is compiled once per context and cached,
+  /// pass a constant. A result without json representation reads "null".
+  String jsonStringifyCall(String source, List args) {
+    _ensureEngine();
+    final ctx = _ctx!;
+    final jsArgs = _dartToJs(ctx, args);
+    final jsRet = _builtinCall(
+      '(fn, args) => JSON.stringify(fn.apply(undefined, args))',
+      [_builtinFunction(source)._val!, jsArgs],
+    );
+    jsFreeValue(ctx, jsArgs);
+    if (jsIsException(jsRet) != 0) {
+      jsFreeValue(ctx, jsRet);
+      throw _parseJSException(ctx);
+    }
+    try {
+      if (jsValueGetTag(jsRet) != JSTag.STRING) return 'null';
+      return utf8.decode(jsToUtf8Bytes(ctx, jsRet), allowMalformed: true);
+    } finally {
+      jsFreeValue(ctx, jsRet);
+    }
+  }
+
+  /// Serialize [value] with the engine's `JSON.stringify` straight into utf8
+  /// bytes. Returns null when the value has no json representation.
+  Uint8List? jsonStringifyBytes(dynamic value) {
+    _ensureEngine();
+    final ctx = _ctx!;
+    final jsArg = _dartToJs(ctx, value);
+    final jsval = _jsonCall('stringify', jsArg);
+    jsFreeValue(ctx, jsArg);
+    if (jsIsException(jsval) != 0) {
+      jsFreeValue(ctx, jsval);
+      throw _parseJSException(ctx);
+    }
+    try {
+      if (jsValueGetTag(jsval) != JSTag.STRING) return null;
+      return jsToUtf8Bytes(ctx, jsval);
+    } finally {
+      jsFreeValue(ctx, jsval);
+    }
+  }
+
+  /// Parse utf8 encoded json with the engine's `JSON.parse`, without building
+  /// js source from it.
+  JsEvalResult jsonParseBytes(List<int> bytes) {
+    _ensureEngine();
+    final ptr = nullTerminatedCopy(bytes);
+    try {
+      return _jsonParseUtf8(ptr, bytes.length);
+    } finally {
+      malloc.free(ptr);
+    }
+  }
+
+  /// Collect json chunk by chunk into native memory, parse it on close.
+  JSONBytesSink jsonParseSink({int initialCapacity = 4096}) {
+    _ensureEngine();
+    return JSONBytesSink._(this, initialCapacity);
+  }
+
+  /// Parse a chunked utf8 json stream such as an http response body.
+  Future<JsEvalResult> jsonParseStream(Stream<List<int>> stream) async {
+    final sink = jsonParseSink();
+    try {
+      await for (final chunk in stream) {
+        sink.add(chunk);
+      }
+    } catch (e) {
+      sink.abort();
+      rethrow;
+    }
+    return sink.close();
+  }
+
+  /// Parse [length] bytes at [str], which is NUL terminated behind them.
+  JsEvalResult _jsonParseUtf8(Pointer<Uint8> str, int length) {
+    _ensureEngine();
+    final ctx = _ctx!;
+    var jsval = jsParseJSON(ctx, str, length);
+    if (jsval == null) {
+      // the string is read up to its first NUL, which would cut it short
+      if (str.asTypedList(length).contains(0)) {
+        final error = JSError('SyntaxError: unexpected NUL byte in JSON');
+        return JsEvalResult(error.toString(), error, isError: true);
+      }
+      final jsStr = jsNewStringFromUtf8(ctx, str);
+      jsval = _jsonCall('parse', jsStr);
+      jsFreeValue(ctx, jsStr);
+    }
+    if (jsIsException(jsval) != 0) {
+      jsFreeValue(ctx, jsval);
+      JSError exception = _parseJSException(ctx);
+      return JsEvalResult(exception.toString(), exception, isError: true);
+    }
+    final result = _jsToDart(ctx, jsval);
+    jsFreeValue(ctx, jsval);
+    return JsEvalResult(result?.toString() ?? "null", result);
+  }
+
+  Pointer<JSValue> _jsonCall(String method, Pointer<JSValue> arg) {
+    return _builtinCall('JSON.$method', [arg]);
+  }
+
+  /// Calls [fn] once per tuple in [argsList]. Arguments go in and results
+  /// come back as one json buffer each, so the number of ffi crossings does
+  /// not grow with the batch size. Whole values json cannot carry are sent
+  /// next to it, see [JSFunctionHandle.callBatch] and [_callBatchDriver].
+  List _callBatch(_JSFunction fn, Iterable<List> argsList) {
+    final ctx = _ctx!;
+    final special = [];
+    final typed = [];
+    final batch = [];
+    var i = 0;
+    for (final args in argsList) {
+      final tuple = List.of(args);
+      for (var j = 0; j < tuple.length; ++j) {
+        final arg = tuple[j];
+        if (arg is double && !arg.isFinite) {
+          special.add([i, j, arg.isNaN ? 0 : arg.sign.toInt()]);
+          tuple[j] = null;
+        } else if (arg is TypedData) {
+          special.add([i, j, 2]);
+          typed.add([
+            _typedArrayName(arg),
+            arg.buffer.asUint8List(arg.offsetInBytes, arg.lengthInBytes),
+          ]);
+          tuple[j] = null;
+        } else {
+          tuple[j] = _jsonSafe(arg);
+        }
+      }
+      batch.add(tuple);
+      ++i;
+    }
+    final ptr = nullTerminatedCopy(utf8.encode(jsonEncode([special, batch])));
+    final jsArgs = jsNewStringFromUtf8(ctx, ptr);
+    malloc.free(ptr);
+    final jsTyped = typed.isEmpty ? null : _dartToJs(ctx, typed);
+    final jsRet = _builtinCall(
+        _callBatchDriver, [fn._val!, jsArgs, if (jsTyped != null) jsTyped]);
+    jsFreeValue(ctx, jsArgs);
+    if (jsTyped != null) jsFreeValue(ctx, jsTyped);
+    if (jsIsException(jsRet) != 0) {
+      jsFreeValue(ctx, jsRet);
+      throw _parseJSException(ctx);
+    }
+    final String json;
+    List buffers = const [];
+    if (jsIsArray(ctx, jsRet) != 0) {
+      final List ret = _jsToDart(ctx, jsRet);
+      json = ret.first;
+      buffers = ret.sublist(1);
+    } else {
+      json = utf8.decode(jsToUtf8Bytes(ctx, jsRet), allowMalformed: true);
+    }
+    jsFreeValue(ctx, jsRet);
+    final List decoded = jsonDecode(json);
+    final List results = decoded[1];
+    var next = 0;
+    for (final List entry in decoded[0]) {
+      final int index = entry[0];
+      final int code = entry[1];
+      results[index] = code == 2
+          ? buffers[next++]
+          : code == 0
+              ? double.nan
+              : code * double.infinity;
+    }
+    return results;
+  }
+
+  _JSFunction _builtinFunction(String source) {
+    final ctx = _ctx!;
+    return _builtinFunctions.putIfAbsent(source, () {
+      final jsval = jsEval(ctx, source, '<builtin>', JSEvalFlag.GLOBAL);
+      if (jsIsException(jsval) != 0) {
+        jsFreeValue(ctx, jsval);
+        throw _parseJSException(ctx);
+      }
+      final fn = _JSFunction(ctx, jsval);
+      jsFreeValue(ctx, jsval);
+      return fn;
+    });
+  }
+
+  Pointer<JSValue> _builtinCall(String source, List<Pointer<JSValue>> args) {
+    final ctx = _ctx!;
+    final fn = _builtinFunction(source);
+    final jsThis = jsUNDEFINED();
+    final jsRet = jsCall(ctx, fn._val!, jsThis, args);
+    jsFreeValue(ctx, jsThis);
+    return jsRet;
   }
 
   @override
@@ -0,0 +1,121 @@
+import 'dart:developer';
+import 'dart:typed_data';
+
+/// Compile time switch for [QuickJsTrace], enable it with
+/// `--dart-define=FLUTTER_JS_TRACE=true`. When off, every trace point is a
+/// constant false branch and is dropped by the compiler.
+const bool kQuickJsTrace = bool.fromEnvironment('FLUTTER_JS_TRACE');
+
+/// Engine crossings and conversions recorded by [QuickJsTrace].
+enum QuickJsTraceEvent {
+  /// `jsEval`, parse and execution together. Bytes are source bytes.
+  eval,
+
+  /// `jsCall` from dart into a js function.
+  call,
+
+  /// One drain of the pending job queue.
+  pendingJobs,
+
+  /// Top level js to dart conversion. Bytes are string code units.
+  jsToDart,
+
+  /// Top level dart to js conversion. Bytes are string code units and
+  /// byte buffer lengths.
+  dartToJs,
+
+  /// Js calling a dart function through the channel.
+  hostCallback,
+
+  /// Batch release of js values whose dart owners were garbage collected.
+  /// Bytes are the number of values released.
+  deferredRelease,
+}
+
+/// Totals of one [QuickJsTraceEvent].
+class QuickJsTraceStat {
+  final int count;
+  final int micros;
+  final int bytes;
+  const QuickJsTraceStat(this.count, this.micros, this.bytes);
+
+  @override
+  String toString() => 'count: $count, time: ${micros}us, bytes: $bytes';
+}
+
+/// Counters for the quickjs bridge, see [kQuickJsTrace].
+///
+/// Every event is also emitted as a `dart:developer` Timeline slice named
+/// `quickjs.<event>`, so it shows up in DevTools next to the frame timeline.
+class QuickJsTrace {
+  static final Stopwatch _clock = Stopwatch()..start();
+  static final _eventCount = QuickJsTraceEvent.values.length;
+  static final Int64List _counts = Int64List(_eventCount);
+  static final Int64List _micros = Int64List(_eventCount);
+  static final Int64List _bytes = Int64List(_eventCount);
+
+  /// Host callback latency, bucket `i` counts calls under `2^i` microseconds.
+  static final Int64List _hostCallbackHistogram = Int64List(24);
+
+  static final Map<String, int> _crossings = {};
+
+  static bool get enabled => kQuickJsTrace;
+
+  /// Start timing [event]. Pass the result to [end].
+  static int begin(QuickJsTraceEvent event) {
+    Timeline.startSync('quickjs.${event.name}');
+    return _clock.elapsedMicroseconds;
+  }
+
+  static void end(QuickJsTraceEvent event, int begin, {int bytes = 0}) {
+    final elapsed = _clock.elapsedMicroseconds - begin;
+    Timeline.finishSync();
+    final i = event.index;
+    _counts[i] += 1;
+    _micros[i] += elapsed;
+    _bytes[i] += bytes;
+    if (event == QuickJsTraceEvent.hostCallback) {
+      var bucket = elapsed <= 0 ? 0 : elapsed.bitLength;
+      if (bucket >= _hostCallbackHistogram.length)
+        bucket = _hostCallbackHistogram.length - 1;
+      _hostCallbackHistogram[bucket] += 1;
+    }
+  }
+
+  /// Count one call of the bridge function [name].
+  static void crossing(String name) {
+    _crossings[name] = (_crossings[name] ?? 0) + 1;
+  }
+
+  /// Attribute [bytes] to [event] without timing it.
+  static void addBytes(QuickJsTraceEvent event, int bytes) {
+    _bytes[event.index] += bytes;
+  }
+
+  /// Copy of the current totals.
+  static Map<QuickJsTraceEvent, QuickJsTraceStat> snapshot() {
+    return {
+      for (final event in QuickJsTraceEvent.values)
+        event: QuickJsTraceStat(
+          _counts[event.index],
+          _micros[event.index],
+          _bytes[event.index],
+        ),
+    };
+  }
+
+  /// Calls from dart into the bridge so far, by exported symbol.
+  static Map<String, int> crossings() => Map.of(_crossings);
+
+  /// Copy of the host callback latency histogram.
+  static List<int> hostCallbackHistogram() =>
+      List.of(_hostCallbackHistogram, growable: false);
+
+  static void reset() {
+    _counts.fillRange(0, _eventCount, 0);
+    _micros.fillRange(0, _eventCount, 0);
+    _bytes.fillRange(0, _eventCount, 0);
+    _hostCallbackHistogram.fillRange(0, _hostCallbackHistogram.length, 0);
+    _crossings.clear();
+  }
+}
@@ -53,8 +53,24 @@ Pointer<JSValue> _jsGetPropertyValue(
   return jsProp;
 }
 
+/// Nesting of [_dartToJs] and [_jsToDart], so that only the outermost
+/// conversion is traced. Error wrapping and property definitions convert
+/// again without a cache and would otherwise be counted twice.
+int _dartToJsDepth = 0;
+int _jsToDartDepth = 0;
+
 Pointer<JSValue> _dartToJs(Pointer<JSContext> ctx, dynamic val,
     {Map<dynamic, Pointer<JSValue>>? cache}) {
+  if (kQuickJsTrace && _dartToJsDepth == 0) {
+    final trace = QuickJsTrace.begin(QuickJsTraceEvent.dartToJs);
+    _dartToJsDepth++;
+    try {
+      return _dartToJs(ctx, val, cache: cache);
+    } finally {
+      _dartToJsDepth--;
+      QuickJsTrace.end(QuickJsTraceEvent.dartToJs, trace);
+    }
+  }
   if (val == null) return jsUNDEFINED();
   if (val is Error) return _dartToJs(ctx, JSError(val, val.stackTrace));
   if (val is Exception) return _dartToJs(ctx, JSError(val));
@@ -66,6 +82,7 @@ Pointer<JSValue> _dartToJs(Pointer<JSContext> ctx, dynamic val,
     return ret;
   }
   if (val is _JSObject) return jsDupValue(ctx, val._val!);
+  if (val is JSObjectView) return jsDupValue(ctx, val._object._val!);
   if (val is Future) {
     final resolvingFunc = malloc<Uint8>(sizeOfJSValue * 2).cast<JSValue>();
     final resolvingFunc2 =
@@ -94,8 +111,14 @@ Pointer<JSValue> _dartToJs(Pointer<JSContext> ctx, dynamic val,
   if (val is bool) return jsNewBool(ctx, val ? 1 : 0);
   if (val is int) return jsNewInt64(ctx, val);
   if (val is double) return jsNewFloat64(ctx, val);
-  if (val is String) return jsNewString(ctx, val);
+  if (val is String) {
+    if (kQuickJsTrace)
+      QuickJsTrace.addBytes(QuickJsTraceEvent.dartToJs, val.length);
+    return jsNewString(ctx, val);
+  }
   if (val is Uint8List) {
+    if (kQuickJsTrace)
+      QuickJsTrace.addBytes(QuickJsTraceEvent.dartToJs, val.length);
     final ptr = malloc<Uint8>(val.length);
     final byteList = ptr.asTypedList(val.length);
     byteList.setAll(0, val);
@@ -130,7 +153,7 @@ Pointer<JSValue> _dartToJs(Pointer<JSContext> ctx, dynamic val,
   final dartObject = jsNewObjectClass(
     ctx,
     dartObjectClassId,
-    identityHashCode(_DartObject(ctx, valWrap)),
+    _DartObject(ctx, valWrap)._id,
   );
   if (valWrap is JSInvokable) {
     final ret = jsNewCFunction(ctx, dartObject);
@@ -140,8 +163,60 @@ Pointer<JSValue> _dartToJs(Pointer<JSContext> ctx, dynamic val,
   return dartObject;
 }
 
+/// Whether [val] is an object or array [_jsToDart] would convert to a
+/// Map or List.
+bool _isPlainObject(Pointer<JSContext> ctx, Pointer<JSValue> val) {
+  if (jsValueGetTag(val) != JSTag.OBJECT) return false;
+  final rt = jsGetRuntime(ctx);
+  final dartObjectClassId = runtimeOpaques[rt]?.dartObjectClassId;
+  if (dartObjectClassId != null &&
+      _DartObject.fromAddress(rt, jsGetObjectOpaque(val, dartObjectClassId)) !=
+          null) return false;
+  if (jsIsArray(ctx, val) != 0) return true;
+  final psize = malloc<IntPtr>();
+  final buf = jsGetArrayBuffer(ctx, psize, val);
+  malloc.free(psize);
+  if (buf.address != 0) return false;
+  return jsIsFunction(ctx, val) == 0 &&
+      jsIsError(ctx, val) == 0 &&
+      jsIsPromise(ctx, val) == 0;
+}
+
+List _jsGetOwnPropertyKeys(Pointer<JSContext> ctx, Pointer<JSValue> val) {
+  final ptab = malloc<Pointer<JSPropertyEnum>>();
+  final plen = malloc<Uint32>();
+  if (jsGetOwnPropertyNames(ctx, ptab, plen, val, -1) != 0) {
+    malloc.free(plen);
+    malloc.free(ptab);
+    return [];
+  }
+  final len = plen.value;
+  malloc.free(plen);
+  final ret = [];
+  for (var i = 0; i < len; ++i) {
+    final jsAtom = jsPropertyEnumGetAtom(ptab.value, i);
+    final jsAtomValue = jsAtomToValue(ctx, jsAtom);
+    ret.add(_jsToDart(ctx, jsAtomValue));
+    jsFreeValue(ctx, jsAtomValue);
+    jsFreeAtom(ctx, jsAtom);
+  }
+  jsFree(ctx, ptab.value);
+  malloc.free(ptab);
+  return ret;
+}
+
 dynamic _jsToDart(Pointer<JSContext> ctx, Pointer<JSValue> val,
     {Map<int, dynamic>? cache}) {
+  if (kQuickJsTrace && _jsToDartDepth == 0) {
+    final trace = QuickJsTrace.begin(QuickJsTraceEvent.jsToDart);
+    _jsToDartDepth++;
+    try {
+      return _jsToDart(ctx, val, cache: cache);
+    } finally {
+      _jsToDartDepth--;
+      QuickJsTrace.end(QuickJsTraceEvent.jsToDart, trace);
+    }
+  }
   if (cache == null) cache = Map();
   final tag = jsValueGetTag(val);
   if (jsTagIsFloat64(tag) != 0) {
@@ -153,7 +228,10 @@ dynamic _jsToDart(Pointer<JSContext> ctx, Pointer<JSValue> val,
     case JSTag.INT:
       return jsToInt64(ctx, val);
     case JSTag.STRING:
-      return jsToCString(ctx, val);
+      final str = jsToCString(ctx, val);
+      if (kQuickJsTrace)
+        QuickJsTrace.addBytes(QuickJsTraceEvent.jsToDart, str.length);
+      return str;
     case JSTag.OBJECT:
       final rt = jsGetRuntime(ctx);
       final dartObjectClassId = runtimeOpaques[rt]?.dartObjectClassId;
@@ -1,6 +1,15 @@
+import 'dart:async';
+import 'dart:convert';
+import 'dart:io';
+import 'dart:isolate';
+import 'dart:typed_data';
+
+import 'package:flutter/services.dart';
 import 'package:flutter_js/extensions/fetch.dart';
+import 'package:flutter_js/extensions/worker.dart';
 import 'package:flutter_js/extensions/xhr.dart';
 import 'package:flutter_js/flutter_js.dart';
+import 'package:flutter_js/quickjs-sync-server/shared_memory_transport.dart';
 import 'package:flutter_test/flutter_test.dart';
 
 void main() {
@@ -60,4 +69,484 @@ void main() {
     print('${asyncResult.stringResult}, ${asyncResult.stringResult}');
     jsRt.dispose();
   });
+
+  test('json bytes round trip', () async {
+    final qjs = QuickJsRuntime2();
+    final parsed = qjs.jsonParseBytes(utf8.encode('{"a":[1,2,{"b":"ü"}]}'));
+    expect(parsed.isError, isFalse);
+    expect(parsed.rawResult['a'][2]['b'], equals('ü'));
+    final bytes = qjs.jsonStringifyBytes(parsed.rawResult)!;
+    expect(utf8.decode(bytes), equals('{"a":[1,2,{"b":"ü"}]}'));
+    expect(qjs.jsonStringifyBytes(null), isNull);
+    final streamed = await qjs.jsonParseStream(
+        Stream.fromIterable([utf8.encode('[1,'), utf8.encode('2]')]));
+    expect(streamed.rawResult, equals([1, 2]));
+    // an embedded NUL must not cut the input short
+    expect(qjs.jsonParseBytes(utf8.encode('[1]\u0000]')).isError, isTrue);
+    final lone = qjs.jsonStringify(qjs.evaluate('"\\ud800"'));
+    expect(lone, isNotEmpty);
+    qjs.dispose();
+  });
+
+  test('json stringify in engine', () {
+    final qjs = QuickJsRuntime2();
+    expect(qjs.jsonStringifyCall('(v) => v', [null]), equals('null'));
+    expect(qjs.jsonStringifyCall('() => undefined', []), equals('null'));
+    expect(qjs.jsonStringifyCall('(a) => ({a})', [1]), equals('{"a":1}'));
+    expect(qjs.jsonStringify(qjs.evaluate('null')), equals('null'));
+    qjs.dispose();
+  });
+
+  test('function handle batch call', () {
+    final qjs = QuickJsRuntime2();
+    final add = qjs.resolveFunction('(a, b) => a + b');
+    expect(add.call([1, 2]), equals(3));
+    expect(add.callBatch([
+      [1, 2],
+      [3, 4],
+      ['a', 'b'],
+    ]), equals([3, 7, 'ab']));
+    expect(qjs.callFunction(add, 1).rawResult, isNaN);
+    final div =
+        qjs.resolveFunction('(a, b) => [a / b, {q: a / b, u: undefined}]');
+    final quotients = div.callBatch([
+      [0, 0],
+      [1, 0],
+      [-1, 0],
+    ]);
+    // nested values follow JSON.stringify
+    expect(quotients[0][0], isNull);
+    expect(quotients[0][1]['q'], isNull);
+    expect(quotients[2][1].containsKey('u'), isFalse);
+    final ratio = qjs.resolveFunction('(a, b) => a / b');
+    final ratios = ratio.callBatch([
+      [0, 0],
+      [1, 0],
+      [double.negativeInfinity, 1],
+    ]);
+    expect(ratios[0], isNaN);
+    expect(ratios[1], equals(double.infinity));
+    expect(ratios[2], equals(double.negativeInfinity));
+    final bytes = qjs.resolveFunction(
+        '(b, f) => [new Uint8Array(b).length, f instanceof Float64Array, f[0]]');
+    final typed = bytes.callBatch([
+      [
+        Uint8List.fromList([1, 2, 3]),
+        Float64List.fromList([0.5]),
+      ],
+    ]);
+    expect(typed[0][0], equals(3));
+    expect(typed[0][1], isTrue);
+    expect(typed[0][2], equals(0.5));
+    final slice = qjs.resolveFunction('(n) => new Uint8Array([n, n + 1])');
+    expect(slice.callBatch([
+      [7],
+    ]), equals([
+      [7, 8],
+    ]));
+    ratio.release();
+    bytes.release();
+    slice.release();
+    expect(() => qjs.resolveFunction('() => () => 1').callBatch([[]]),
+        throwsA(isA<JSError>()));
+    div.release();
+    add.release();
+    expect(add.isReleased, isTrue);
+    qjs.dispose();
+  });
+
+  test('lazy object view', () {
+    final qjs = QuickJsRuntime2();
+    final result =
+        qjs.evaluate('({a: {b: [1, 2, 3, {c: "x"}]}, n: 4})', lazy: true);
+    final JSObjectView view = result.rawResult;
+    expect(view.keys, equals(['a', 'n']));
+    expect(view['n'], equals(4));
+    expect(view['a']['b'].length, equals(4));
+    expect(view.at(['a', 'b', 3, 'c']), equals('x'));
+    expect(view.at(['n', 'missing', 0]), isNull);
+    expect(view.materialize(), equals({
+      'a': {
+        'b': [
+          1,
+          2,
+          3,
+          {'c': 'x'}
+        ]
+      },
+      'n': 4
+    }));
+    final keysOf = qjs.resolveFunction('(o) => Object.keys(o).join()');
+    expect(keysOf.call([view]), equals('a,n'));
+    expect(utf8.decode(qjs.jsonStringifyBytes(view['a'])!),
+        equals('{"b":[1,2,3,{"c":"x"}]}'));
+    keysOf.release();
+    qjs.dispose();
+  });
+
+  test('live handle stats', () {
+    final qjs = QuickJsRuntime2();
+    final before = qjs.liveHandleStats['JSObject'] ?? 0;
+    final JSObjectView view = qjs.evaluate('({a: 1})', lazy: true).rawResult;
+    expect(qjs.liveHandleStats['JSObject'], equals(before + 1));
+    view.release();
+    expect(qjs.liveHandleStats['JSObject'] ?? 0, equals(before));
+    final JSObjectView live = qjs.evaluate('[1, 2]', lazy: true).rawResult;
+    qjs.dispose();
+    expect(qjs.lastTeardownStats['JSObject'], greaterThan(0));
+    expect(live.isReleased, isTrue);
+  });
+
+  test('cpu quota', () {
+    expect(QuickJsRuntime2().usage, isNull);
+    final qjs = QuickJsRuntime2(cpuQuota: Duration(milliseconds: 20));
+    qjs.resetUsage();
+    final runaway = qjs.evaluate(jsCanInterrupt
+        ? 'while (true) {}'
+        : 'let s = 0; for (let i = 0; i < 1e7; i++) s += i;');
+    expect(qjs.usage!.evalCount, equals(1));
+    if (jsCanInterrupt) {
+      expect(runaway.isError, isTrue);
+      expect(qjs.usage!.interruptCount, equals(1));
+    }
+    final result = qjs.evaluate('1 + 1');
+    expect(result.isError, isTrue);
+    expect(result.stringResult, contains('cpu quota'));
+    qjs.resetUsage();
+    expect(qjs.evaluate('1 + 1').rawResult, equals(2));
+    qjs.dispose();
+  });
+
+  test('timeout with usage tracking', () {
+    final qjs = QuickJsRuntime2(timeout: 50, trackUsage: true);
+    if (jsCanInterrupt) {
+      expect(qjs.evaluate('while (true) {}').isError, isTrue);
+      expect(qjs.usage!.interruptCount, equals(1));
+    }
+    expect(qjs.evaluate('1 + 1').rawResult, equals(2));
+    qjs.dispose();
+  });
+
+  test('memory usage', () {
+    final qjs = QuickJsRuntime2();
+    final before = qjs.memoryUsage;
+    qjs.evaluate('var big = Array.from({length: 1000}, (_, i) => ({i}));');
+    final after = qjs.memoryUsage;
+    if (after.isNotEmpty) {
+      expect(after['objCount'], greaterThan(before['objCount']! + 1000));
+      expect(after['mallocSize'], greaterThan(before['mallocSize']!));
+    }
+    qjs.dispose();
+  });
+
+  test('trace counters', () {
+    QuickJsTrace.reset();
+    final qjs = QuickJsRuntime2();
+    qjs.evaluate('[1, 2, 3].map((i) => i * 2)');
+    final evals = QuickJsTrace.snapshot()[QuickJsTraceEvent.eval]!;
+    if (QuickJsTrace.enabled) {
+      expect(evals.count, greaterThan(0));
+      expect(evals.bytes, greaterThan(0));
+    } else {
+      expect(evals.count, equals(0));
+    }
+    qjs.dispose();
+  });
+
+  // These run with `flutter test --dart-define=FLUTTER_JS_TRACE=true`.
+  group('trace', () {
+    final skip =
+        QuickJsTrace.enabled ? false : 'needs FLUTTER_JS_TRACE=true defined';
+
+    test('crossings by function', () {
+      final qjs = QuickJsRuntime2();
+      QuickJsTrace.reset();
+      qjs.evaluate('1 + 1');
+      final crossings = QuickJsTrace.crossings();
+      expect(crossings['jsEval'], equals(1));
+      expect(crossings['jsFreeValue'], greaterThan(0));
+      expect(crossings.containsKey('jsCall'), isFalse);
+      qjs.dispose();
+    }, skip: skip);
+
+    test('nested conversions count once', () {
+      final qjs = QuickJsRuntime2();
+      final message = qjs.resolveFunction('(e) => e.message');
+      QuickJsTrace.reset();
+      expect(message.call([Exception('boom')]), contains('boom'));
+      final stats = QuickJsTrace.snapshot();
+      // The argument and this, not the error wrapping or its properties.
+      expect(stats[QuickJsTraceEvent.dartToJs]!.count, equals(2));
+      expect(stats[QuickJsTraceEvent.jsToDart]!.count, equals(1));
+      expect(QuickJsTrace.crossings()['jsCall'], equals(1));
+      message.release();
+      qjs.dispose();
+    }, skip: skip);
+  });
+
+  test('worker post message', () async {
+    final qjs = QuickJsRuntime2();
+    qjs.enableWorkers();
+    qjs.evaluate('''
+      var reply = null;
+      var w = new Worker("onmessage = (e) => postMessage(e.data * 2);");
+      w.onmessage = (e) => { reply = e.data; };
+      w.postMessage(21);
+    ''');
+    for (var i = 0; i < 100 && qjs.evaluate('reply').rawResult == null; i++) {
+      await Future.delayed(Duration(milliseconds: 20));
+    }
+    expect(qjs.evaluate('reply').rawResult, equals(42));
+    qjs.terminateWorkers();
+    qjs.dispose();
+  });
+
+  test('worker structured clone', () async {
+    final qjs = QuickJsRuntime2();
+    qjs.enableWorkers();
+    qjs.evaluate('''
+      var reply = null;
+      var w = new Worker("onmessage = (e) => { e.data.self = e.data; postMessage(e.data); };");
+      w.onmessage = (e) => { reply = e.data; };
+      w.postMessage({m: new Map([[1, 'a']]), s: new Set([2]), d: new Date(5),
+          u: undefined, n: NaN, b: new Uint8Array([1, 2])});
+    ''');
+    for (var i = 0; i < 100 && qjs.evaluate('reply').rawResult == null; i++) {
+      await Future.delayed(Duration(milliseconds: 20));
+    }
+    expect(
+        qjs.evaluate('''
+          reply.self === reply && reply.m.get(1) === 'a' && reply.s.has(2) &&
+          reply.d.getTime() === 5 && 'u' in reply && reply.u === undefined &&
+          Number.isNaN(reply.n) && reply.b instanceof Uint8Array &&
+          reply.b[1] === 2
+        ''').rawResult,
+        isTrue);
+    expect(qjs.evaluate('try { w.postMessage(() => 1) } catch (e) { e.name }')
+        .rawResult, equals('DataCloneError'));
+    if (jsCanShareMemory) {
+      qjs.evaluate('''
+        var shared = new Int32Array(new SharedArrayBuffer(4));
+        var stored = false;
+        var w2 = new Worker("onmessage = (e) => { Atomics.store(e.data, 0, 7); postMessage(0); };");
+        w2.onmessage = () => { stored = true; };
+        w2.postMessage(shared);
+      ''');
+      for (var i = 0; i < 100 && qjs.evaluate('stored').rawResult != true; i++) {
+        await Future.delayed(Duration(milliseconds: 20));
+      }
+      expect(qjs.evaluate('Atomics.load(shared, 0)').rawResult, equals(7));
+    }
+    qjs.dispose();
+  });
+
+  test('workers stop on dispose', () async {
+    final qjs = QuickJsRuntime2();
+    qjs.enableWorkers();
+    qjs.evaluate('''
+      var w = new Worker("onmessage = (e) => { for (let i = 0; i < 5; i++) postMessage(i); };");
+      w.onmessage = (e) => {};
+      w.postMessage(0);
+    ''');
+    qjs.dispose();
+    await Future.delayed(Duration(milliseconds: 200));
+    expect(qjs.isDisposed, isTrue);
+    expect(qjs.dartContext[WORKERS_KEY], isEmpty);
+    // late worker messages must not bring the engine back
+    expect(qjs.liveHandleStats, isEmpty);
+  });
+
+  test('evaluate file', () {
+    final qjs = QuickJsRuntime2();
+    final dir = Directory.systemTemp.createTempSync('flutter_js');
+    final small = File('${dir.path}/small.js')..writeAsStringSync('6 * 7');
+    // exactly one page, evaluated from a copy instead of a mapping
+    final paged = File('${dir.path}/paged.js')
+      ..writeAsStringSync('1 + 1;'.padRight(4096));
+    expect(qjs.evaluateFile(small.path).rawResult, equals(42));
+    expect(qjs.evaluateFile(paged.path).rawResult, equals(2));
+    expect(qjs.evaluateFile(small.path, map: false).rawResult, equals(42));
+    if (jsCanEvalBytecode) {
+      final bytecode = qjs.compileBytecode('var answer = 6 * 7; answer');
+      expect(qjs.evaluateBytecode(bytecode).rawResult, equals(42));
+      expect(qjs.evaluate('answer').rawResult, equals(42));
+      expect(() => qjs.compileBytecode('let ='), throwsA(isA<JSError>()));
+    } else {
+      expect(() => qjs.compileBytecode('1'), throwsUnsupportedError);
+    }
+    dir.deleteSync(recursive: true);
+    qjs.dispose();
+  });
+
+  test('command buffer', () {
+    final qjs = QuickJsRuntime2();
+    final commands = JSCommandBuffer()
+      ..defineGlobal('base', 10)
+      ..defineGlobal('twice', (int v) => v * 2)
+      ..eval('var total = 0; Promise.resolve().then(() => total = base + 1);')
+      ..drainJobs()
+      ..getPath(['total'])
+      ..callPath(['twice'], [21])
+      ..eval('const answer = 42;')
+      ..eval('answer + 1')
+      ..callPath(['missing'])
+      ..eval('unreachable');
+    final results = qjs.execute(commands);
+    expect(results.length, equals(9));
+    expect(results[4].rawResult, equals(11));
+    expect(results[5].rawResult, equals(42));
+    expect(results[7].rawResult, equals(43));
+    expect(results[8].isError, isTrue);
+    expect(qjs.evaluate('answer').rawResult, equals(42));
+    qjs.dispose();
+  });
+
+  test('compiled property path', () {
+    final qjs = QuickJsRuntime2();
+    final JSObjectView data = qjs.evaluate('''({
+      items: [
+        {name: 'a', price: 1.5, qty: 2},
+        {name: 'b', price: 3, qty: 1},
+        {name: 'c'},
+      ]
+    })''', lazy: true).rawResult;
+    final price = qjs.compilePath('items[1].price');
+    expect(price.path, equals(['items', 1, 'price']));
+    expect(price.getDouble(data), equals(3.0));
+    expect(price.getInt(data), equals(3));
+    expect(qjs.compilePath('items[0].name').getString(data), equals('a'));
+    final JSObjectView items = data['items'];
+    expect(qjs.compilePath('qty').columnInt(items), equals([2, 1, null]));
+    final prices = qjs.compilePath(['price']).columnDouble(items);
+    expect(prices.sublist(0, 2), equals([1.5, 3.0]));
+    expect(prices[2].isNaN, isTrue);
+    final names = qjs.compilePath('name');
+    final before = qjs.liveHandleStats['JSPropertyPath'] ?? 0;
+    expect(names.columnString(items), equals(['a', 'b', 'c']));
+    expect(names.columnOf(items), equals(['a', 'b', 'c']));
+    expect(qjs.liveHandleStats['JSPropertyPath'], equals(before + 1));
+    names.release();
+    expect(qjs.liveHandleStats['JSPropertyPath'] ?? 0, equals(before));
+    // the atoms belong to the closed engine, the path compiles again
+    qjs.close();
+    expect(
+        price.getDouble({
+          'items': [
+            {},
+            {'price': 7.5}
+          ]
+        }),
+        equals(7.5));
+    price.release();
+    qjs.dispose();
+  });
+
+  test('lazy polyfills', () {
+    int sourceBytes(bool lazy) {
+      final qjs = QuickJsRuntime2(trackUsage: true, lazyPolyfills: lazy);
+      qjs.enableXhr();
+      qjs.enableHandlePromises();
+      final bytes = qjs.usage!.sourceBytes;
+      qjs.dispose();
+      return bytes;
+    }
+
+    expect(sourceBytes(true), lessThan(sourceBytes(false)));
+
+    final qjs = QuickJsRuntime2(lazyPolyfills: true);
+    qjs.enableXhr();
+    qjs.enableHandlePromises();
+    expect(qjs.evaluate('typeof console.log').stringResult,
+        equals('function'));
+    expect(qjs.evaluate('typeof XMLHttpRequest').stringResult,
+        equals('function'));
+    qjs.evaluate("""
+      Object.defineProperty(globalThis, 'FLUTTER_NATIVEJS_CLEAN_PROMISE', {
+        value: 42, writable: true, configurable: true,
+      });
+    """);
+    qjs.installLazyGlobals();
+    expect(qjs.evaluate('FLUTTER_NATIVEJS_CLEAN_PROMISE').rawResult,
+        equals(42));
+    expect(
+        qjs.evaluate('typeof FLUTTER_NATIVEJS_IS_PENDING_PROMISE').stringResult,
+        equals('function'));
+    qjs.dispose();
+
+    final eager = QuickJsRuntime2();
+    eager.enableXhr();
+    expect(eager.evaluate('Object.getOwnPropertyDescriptor(globalThis, '
+            '"XMLHttpRequest").get === undefined').rawResult,
+        isTrue);
+    eager.dispose();
+  });
+
+  test('shared memory transport', () async {
+    final transport = SharedMemoryTransport.create(capacity: 4096);
+    final isolate = await Isolate.spawn(_echoTransport, transport.address);
+    for (final size in [0, 5, 4000, 100000]) {
+      final payload = List<int>.generate(size, (i) => i & 0xff);
+      transport.send(7, payload);
+      final frame = transport.receive()!;
+      expect(frame.op, equals(8));
+      expect(frame.payload, equals(payload));
+    }
+    expect(transport.receive(timeout: Duration(milliseconds: 1)), isNull);
+    final fd = transport.inboundFd;
+    expect(SharedMemoryTransport.waitForFrames(fd, timeout: Duration.zero),
+        isFalse);
+    transport.send(7, const [1]);
+    expect(SharedMemoryTransport.waitForFrames(fd), isTrue);
+    expect(transport.receive(timeout: Duration.zero)!.payload, equals([1]));
+    transport.send(0, const []);
+    transport.receive();
+    transport.hangUp();
+    expect(transport.receive(), isNull);
+    expect(() => transport.send(7, const [1]), throwsStateError);
+    isolate.kill();
+    transport.close();
+  });
+
+  test('quickjs service', () async {
+    TestDefaultBinaryMessengerBinding.instance.defaultBinaryMessenger
+        .setMockMethodCallHandler(const MethodChannel('io.abner.flutter_js'),
+            (call) async => call.method == 'initEngine' ? {} : null);
+    final service = QuickJsService(FlutterJs());
+    expect(service.evaluate('1 + 2').rawResult, equals(3));
+    expect(service.evaluate('({a: [1, "b"]})').rawResult,
+        equals({
+          'a': [1, 'b']
+        }));
+    expect(service.evaluate('throw new Error("boom")').isError, isTrue);
+    expect(() => service.onMessage('ConsoleLog', (dynamic args) {}),
+        throwsArgumentError);
+
+    // sent from a timer, while no request is running
+    final pings = StreamController<dynamic>();
+    service.onMessage('ping', (dynamic args) => pings.add(args));
+    service.evaluate(
+        "setTimeout(() => sendMessage('ping', JSON.stringify({n: 1})), 10)");
+    expect(await pings.stream.first, equals({'n': 1}));
+
+    final fulfilled =
+        service.evaluate('new Promise((r) => setTimeout(() => r(7), 10))');
+    expect(fulfilled.isPromise, isTrue);
+    expect((await service.handlePromise(fulfilled)).stringResult, equals('7'));
+    final rejected = service.evaluate('Promise.reject("no")');
+    await expectLater(rejected.rawResult as Future, throwsA(anything));
+
+    service.dispose();
+    expect(service.failure, isNotNull);
+    expect(service.evaluate('1').isError, isTrue);
+  });
+}
+
+void _echoTransport(List<int> address) {
+  final transport = SharedMemoryTransport.attach(address);
+  while (true) {
+    final frame = transport.receive()!;
+    transport.send(frame.op + 1, frame.payload);
+    if (frame.op == 0) break;
+  }
+  transport.close();
 }